@@ -0,0 +1,320 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+  Headless replay of a key sequence through the same Images::getFrame path
+  the viewer uses, on synthetic images generated at several resolutions.
+  Reports time to first frame, load throughput and frame time percentiles,
+  and separately how long the placeholders some frames start as take to be
+  replaced by the image. A resolution over OpenCV's 2^30 pixel decode limit
+  gets a single image written a strip at a time, which is viewed through a
+  tile pyramid built at the start of its run.
+*/
+
+#include <iomanip>
+#include <iostream>
+#include <stdio.h>
+
+#include <jpeglib.h>
+
+#include "images.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+DEFINE_int32(width, 800, "width");
+DEFINE_int32(height, 600, "height");
+DEFINE_double(max_scale, 1.5, "maximum amount to scale the image");
+DEFINE_int32(decode_threads, 0,
+             "number of image decode/resize threads, 0 for one per core");
+DEFINE_int32(cache_mb, 1024,
+             "memory budget in megabytes for full resolution frames");
+DEFINE_int32(render_ahead, 4,
+             "views to render ahead on each side of the current one, 0 for "
+             "none");
+DEFINE_int32(render_mb, 256, "memory budget in megabytes for views rendered "
+                             "ahead");
+DEFINE_bool(smooth, false,
+            "bilinear instead of nearest neighbor resampling");
+DEFINE_int32(refine_ms, 150,
+             "re-render the view with area or cubic interpolation once it "
+             "has been still this long, 0 for never");
+DEFINE_bool(mmap_originals, false,
+            "keep the image files mapped and decode full resolution frames "
+            "from them on demand, cache_mb can then be much smaller");
+DEFINE_bool(thumb_cache, false,
+            "use an on-disk scaled frame cache in bench_dir, which makes "
+            "every run after the first measure cached loading");
+DEFINE_string(bench_dir, "/tmp/vimaj_bench",
+              "where the synthetic images are generated");
+DEFINE_string(resolutions, "640x480,2000x1500,6000x4000",
+              "comma separated sizes of the synthetic image sets, one over "
+              "2^30 pixels such as 33000x33000 is a single tiled image");
+DEFINE_int32(tile_timeout_s, 600,
+             "longest to wait for the pyramid of an image over 2^30 pixels");
+DEFINE_int32(num_images, 30, "synthetic images per resolution");
+// 'p' works too but the saved crops end up in the next run's image set
+DEFINE_string(keys, "jjjjjkkkhhhhhhhhhhsdsdsdafaflllllllllllgjjkjjk",
+              "key sequence to replay");
+DEFINE_int32(repeat, 5, "how many times to replay the key sequence");
+DEFINE_string(stats_json, "",
+              "where to write the per stage timings of all the runs");
+DEFINE_int32(refine_timeout_ms, 10000,
+             "longest to wait for a placeholder to be replaced");
+DEFINE_double(max_p95_ms, 0.0,
+              "exit with an error if any p95 frame time is larger, 0 to only "
+              "report");
+
+static double secondsSince(const boost::posix_time::ptime t0) {
+  return (boost::posix_time::microsec_clock::universal_time() - t0)
+             .total_microseconds() /
+         1e6;
+}
+
+// times needs to be sorted
+static double percentile(const std::vector<double> &times, const double p) {
+  if (times.empty())
+    return 0.0;
+  return times[(size_t)(p * (times.size() - 1) + 0.5)];
+}
+
+/* Write num images of size sz into dir unless they are already there, with
+ * gradients, edges and noise so they compress and decode roughly like photos.
+ */
+static bool generateImages(const std::string &dir, const cv::Size sz,
+                           const int num) {
+  try {
+    boost::filesystem::create_directories(dir);
+  } catch (const boost::filesystem::filesystem_error &ex) {
+    LOG(ERROR) << CLERR << ex.what() << CLNRM;
+    return false;
+  }
+
+  uint32_t noise = 12345;
+  for (int i = 0; i < num; ++i) {
+    std::stringstream name;
+    name << dir << "/synth_" << std::setfill('0') << std::setw(4) << i
+         << ".jpg";
+    if (boost::filesystem::exists(name.str()))
+      continue;
+
+    cv::Mat im(sz, CV_8UC3);
+    for (int y = 0; y < im.rows; ++y) {
+      uchar *row = im.ptr(y);
+      for (int x = 0; x < im.cols; ++x) {
+        noise = noise * 1664525 + 1013904223;
+        row[x * 3] = x * 255 / im.cols;
+        row[x * 3 + 1] = y * 255 / im.rows;
+        row[x * 3 + 2] =
+            ((((x >> 5) + (y >> 5) + i) & 1) ? 180 : 60) + (noise >> 28);
+      }
+    }
+    std::stringstream label;
+    label << i << " " << sz.width << "x" << sz.height;
+    cv::putText(im, label.str(), cv::Point(sz.width / 10, sz.height / 2), 1,
+                sz.width / 200.0, cv::Scalar::all(255), sz.width / 400 + 1);
+    if (!cv::imwrite(name.str(), im)) {
+      LOG(ERROR) << CLERR << "couldn't write " << CLNRM << name.str();
+      return false;
+    }
+  }
+  return true;
+}
+
+/* The same pattern as generateImages, written a row at a time with libjpeg
+ * since OpenCV would need the whole image in memory.
+ */
+static bool generateHugeImage(const std::string &name, const cv::Size sz) {
+  if (boost::filesystem::exists(name))
+    return true;
+  FILE *file = fopen(name.c_str(), "wb");
+  if (file == NULL) {
+    LOG(ERROR) << CLERR << "couldn't write " << CLNRM << name;
+    return false;
+  }
+  struct jpeg_compress_struct jpeg;
+  struct jpeg_error_mgr error;
+  jpeg.err = jpeg_std_error(&error);
+  jpeg_create_compress(&jpeg);
+  jpeg_stdio_dest(&jpeg, file);
+  jpeg.image_width = sz.width;
+  jpeg.image_height = sz.height;
+  jpeg.input_components = 3;
+  jpeg.in_color_space = JCS_EXT_BGR;
+  jpeg_set_defaults(&jpeg);
+  jpeg_set_quality(&jpeg, 90, TRUE);
+  jpeg_start_compress(&jpeg, TRUE);
+  std::vector<unsigned char> row(sz.width * 3);
+  uint32_t noise = 12345;
+  for (int y = 0; y < sz.height; ++y) {
+    for (int x = 0; x < sz.width; ++x) {
+      noise = noise * 1664525 + 1013904223;
+      row[x * 3] = (int64_t)x * 255 / sz.width;
+      row[x * 3 + 1] = (int64_t)y * 255 / sz.height;
+      row[x * 3 + 2] = ((((x >> 5) + (y >> 5)) & 1) ? 180 : 60) + (noise >> 28);
+    }
+    JSAMPROW rows = &row[0];
+    jpeg_write_scanlines(&jpeg, &rows, 1);
+  }
+  jpeg_finish_compress(&jpeg);
+  jpeg_destroy_compress(&jpeg);
+  if (fclose(file) != 0) {
+    LOG(ERROR) << CLERR << "couldn't write " << CLNRM << name;
+    unlink(name.c_str());
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  google::InitGoogleLogging(argv[0]);
+  google::LogToStderr();
+  google::ParseCommandLineFlags(&argc, &argv, false);
+
+  bool pass = true;
+  std::stringstream resolutions(FLAGS_resolutions);
+  std::string resolution;
+  while (std::getline(resolutions, resolution, ',')) {
+    cv::Size res;
+    char x;
+    std::stringstream ss(resolution);
+    if (!(ss >> res.width >> x >> res.height) || (x != 'x')) {
+      LOG(ERROR) << CLERR << "bad resolution " << CLNRM << resolution;
+      return 1;
+    }
+
+    const std::string dir = FLAGS_bench_dir + "/" + resolution;
+    const bool huge = (int64_t)res.width * res.height > ((int64_t)1 << 30);
+    const int num_images = huge ? 1 : FLAGS_num_images;
+    LOG(INFO) << "generating " << num_images << " " << resolution
+              << " images in " << dir;
+    if (huge) {
+      try {
+        boost::filesystem::create_directories(dir);
+      } catch (const boost::filesystem::filesystem_error &ex) {
+        LOG(ERROR) << CLERR << ex.what() << CLNRM;
+        return 1;
+      }
+      if (!generateHugeImage(dir + "/huge.jpg", res))
+        return 1;
+    } else if (!generateImages(dir, res, num_images)) {
+      return 1;
+    }
+
+    ImagesConfig config;
+    config.sz = cv::Size(FLAGS_width, FLAGS_height);
+    config.max_scale = FLAGS_max_scale;
+    config.decode_threads = FLAGS_decode_threads;
+    config.cache_mb = FLAGS_cache_mb;
+    config.render_ahead = FLAGS_render_ahead;
+    config.render_mb = FLAGS_render_mb;
+    config.smooth = FLAGS_smooth;
+    config.refine_ms = FLAGS_refine_ms;
+    config.mmap_originals = FLAGS_mmap_originals;
+    if (FLAGS_thumb_cache)
+      config.thumb_cache_dir = FLAGS_bench_dir + "/cache";
+    config.roots.push_back(dir);
+    if (huge) {
+      // built again every run, that being what is timed
+      config.tile_dir = FLAGS_bench_dir + "/tiles";
+      boost::filesystem::remove_all(config.tile_dir);
+    }
+
+    const boost::posix_time::ptime t0 =
+        boost::posix_time::microsec_clock::universal_time();
+    Images images(config);
+    View view;
+
+    // a huge image only appears once its pyramid is built, after loading
+    while ((images.getNum() == 0) &&
+           (huge ? (secondsSince(t0) < FLAGS_tile_timeout_s)
+                 : !images.isLoaded()))
+      usleep(1000);
+    if (images.getNum() == 0) {
+      LOG(ERROR) << CLERR << resolution << " nothing to show" << CLNRM;
+      pass = false;
+      images.continue_loading = false;
+      continue;
+    }
+    images.getFrame(images.ind, view.zoom, view.pos);
+    const double first_frame = secondsSince(t0);
+
+    while (!images.isLoaded())
+      usleep(1000);
+    const double load_time = secondsSince(t0);
+    const int num = images.getNum();
+
+    std::vector<double> times;
+    // from the key to the image replacing a placeholder, as the viewer
+    // would show it
+    std::vector<double> refine_times;
+    for (int i = 0; i < FLAGS_repeat; ++i) {
+      for (size_t j = 0; j < FLAGS_keys.size(); ++j) {
+        handleKey(images, view, FLAGS_keys[j]);
+        const boost::posix_time::ptime t1 =
+            boost::posix_time::microsec_clock::universal_time();
+        images.getFrame(images.ind, view.zoom, view.pos);
+        times.push_back(secondsSince(t1) * 1000.0);
+        if (!images.isPlaceholder())
+          continue;
+        while (images.isPlaceholder() &&
+               (secondsSince(t1) * 1000.0 < FLAGS_refine_timeout_ms)) {
+          if (images.refineReady())
+            images.getFrame(images.ind, view.zoom, view.pos);
+          else
+            usleep(1000);
+        }
+        if (images.isPlaceholder())
+          LOG(WARNING) << CLWRN << "placeholder not replaced after "
+                       << FLAGS_refine_timeout_ms << " ms" << CLNRM;
+        refine_times.push_back(secondsSince(t1) * 1000.0);
+      }
+    }
+    std::sort(times.begin(), times.end());
+    std::sort(refine_times.begin(), refine_times.end());
+
+    const double p95 = percentile(times, 0.95);
+    std::cout << resolution << ": " << num << " images, first frame "
+              << first_frame * 1000.0 << " ms, load " << load_time << " s "
+              << ((load_time > 0) ? num / load_time : 0.0)
+              << " images/s, frame ms p50 " << percentile(times, 0.5)
+              << " p95 " << p95 << " p99 " << percentile(times, 0.99)
+              << " max " << percentile(times, 1.0) << " (" << times.size()
+              << " frames), refined ms p50 " << percentile(refine_times, 0.5)
+              << " p95 " << percentile(refine_times, 0.95) << " max "
+              << percentile(refine_times, 1.0) << " (" << refine_times.size()
+              << " placeholders)" << std::endl;
+
+    if ((FLAGS_max_p95_ms > 0) && (p95 > FLAGS_max_p95_ms)) {
+      LOG(ERROR) << CLERR << resolution << " p95 " << p95 << " ms over "
+                 << FLAGS_max_p95_ms << CLNRM;
+      pass = false;
+    }
+
+    images.continue_loading = false;
+  }
+
+  if (!FLAGS_stats_json.empty()) {
+    Stats::get().setJsonPath(FLAGS_stats_json);
+    Stats::get().writeJson();
+  }
+
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,225 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIMAJ_BLIT_H
+#define VIMAJ_BLIT_H
+
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+/* Output sized frames that are reused once nothing else refers to them, so
+ * steady state rendering doesn't allocate.
+ */
+class FramePool {
+  boost::mutex mutex;
+  std::vector<cv::Mat> frames;
+  size_t max_frames;
+
+public:
+  FramePool(const size_t max_frames = 16) : max_frames(max_frames) {}
+
+  // the contents are whatever was there last
+  cv::Mat acquire(const cv::Size sz, const int type) {
+    boost::mutex::scoped_lock l(mutex);
+    for (size_t i = 0; i < frames.size(); ++i) {
+      cv::Mat &frame = frames[i];
+      // only the pool refers to it, nobody can take another reference
+      // meanwhile
+      if ((frame.u != NULL) && (frame.u->refcount == 1) &&
+          (frame.size() == sz) && (frame.type() == type))
+        return frame;
+    }
+    cv::Mat frame(sz, type);
+    if (frames.size() < max_frames) {
+      frames.push_back(frame);
+    } else {
+      // replace one that is free but the wrong size
+      for (size_t i = 0; i < frames.size(); ++i) {
+        if ((frames[i].u != NULL) && (frames[i].u->refcount == 1)) {
+          frames[i] = frame;
+          break;
+        }
+      }
+    }
+    return frame;
+  }
+};
+
+/* Resample a roi of the source straight into a rectangle of the destination,
+ * the part of it inside the destination anyway, in one pass without an
+ * intermediate resized image. Specialized per channel count so the per
+ * pixel loops have constant trip counts the compiler can unroll and
+ * vectorize. Keeps its column tables between calls, use one per thread.
+ */
+class Resampler {
+  // byte offsets into a source row of each visible destination column
+  std::vector<int> xofs;
+  std::vector<int> xofs1;
+  // weight of xofs1 out of 256
+  std::vector<int> xw;
+
+  // the src channel dst channel c comes from, a wider dst repeating the
+  // last src channel into the rest
+  template <int CN> static int srcChannel(const int c) {
+    return std::min(c, CN - 1);
+  }
+
+  template <int CN, int DCN>
+  void nearest(const cv::Mat &src, const cv::Rect &src_roi, cv::Mat &dst,
+               const cv::Rect &dst_rect, const cv::Rect &vis) {
+    for (int x = 0; x < vis.width; ++x) {
+      const int sx = (int64_t)(vis.x + x - dst_rect.x) * src_roi.width /
+                     dst_rect.width;
+      xofs[x] = (src_roi.x + std::min(sx, src_roi.width - 1)) * CN;
+    }
+
+    int last_sy = -1;
+    for (int y = vis.y; y < vis.y + vis.height; ++y) {
+      const int sy =
+          src_roi.y + std::min((int)((int64_t)(y - dst_rect.y) *
+                                     src_roi.height / dst_rect.height),
+                               src_roi.height - 1);
+      uchar *d = dst.ptr(y) + vis.x * DCN;
+      if (sy == last_sy) {
+        // zoomed in rows repeat
+        memcpy(d, dst.ptr(y - 1) + vis.x * DCN, vis.width * DCN);
+        continue;
+      }
+      last_sy = sy;
+      const uchar *s = src.ptr(sy);
+      for (int x = 0; x < vis.width; ++x) {
+        const uchar *p = s + xofs[x];
+        for (int c = 0; c < DCN; ++c)
+          d[x * DCN + c] = p[srcChannel<CN>(c)];
+      }
+    }
+  }
+
+  template <int CN, int DCN>
+  void linear(const cv::Mat &src, const cv::Rect &src_roi, cv::Mat &dst,
+              const cv::Rect &dst_rect, const cv::Rect &vis) {
+    // sample centers line up, and the edges clamp to the roi
+    const double scale_x = (double)src_roi.width / dst_rect.width;
+    for (int x = 0; x < vis.width; ++x) {
+      const double fx = (vis.x + x - dst_rect.x + 0.5) * scale_x - 0.5;
+      int sx = (int)floor(fx);
+      int w = (int)((fx - sx) * 256);
+      if (sx < 0) {
+        sx = 0;
+        w = 0;
+      }
+      if (sx >= src_roi.width - 1) {
+        sx = src_roi.width - 1;
+        w = 0;
+      }
+      xofs[x] = (src_roi.x + sx) * CN;
+      xofs1[x] = (src_roi.x + std::min(sx + 1, src_roi.width - 1)) * CN;
+      xw[x] = w;
+    }
+
+    const double scale_y = (double)src_roi.height / dst_rect.height;
+    for (int y = vis.y; y < vis.y + vis.height; ++y) {
+      const double fy = (y - dst_rect.y + 0.5) * scale_y - 0.5;
+      int sy = (int)floor(fy);
+      int wy = (int)((fy - sy) * 256);
+      if (sy < 0) {
+        sy = 0;
+        wy = 0;
+      }
+      if (sy >= src_roi.height - 1) {
+        sy = src_roi.height - 1;
+        wy = 0;
+      }
+      const uchar *s0 = src.ptr(src_roi.y + sy);
+      const uchar *s1 =
+          src.ptr(src_roi.y + std::min(sy + 1, src_roi.height - 1));
+      uchar *d = dst.ptr(y) + vis.x * DCN;
+      for (int x = 0; x < vis.width; ++x) {
+        const int w1 = xw[x];
+        const int w0 = 256 - w1;
+        const uchar *a0 = s0 + xofs[x];
+        const uchar *a1 = s0 + xofs1[x];
+        const uchar *b0 = s1 + xofs[x];
+        const uchar *b1 = s1 + xofs1[x];
+        for (int c = 0; c < DCN; ++c) {
+          const int sc = srcChannel<CN>(c);
+          const int top = a0[sc] * w0 + a1[sc] * w1;
+          const int bottom = b0[sc] * w0 + b1[sc] * w1;
+          d[x * DCN + c] = (top * (256 - wy) + bottom * wy + (1 << 15)) >> 16;
+        }
+      }
+    }
+  }
+
+  template <int CN, int DCN>
+  void resample(const cv::Mat &src, const cv::Rect &src_roi, cv::Mat &dst,
+                const cv::Rect &dst_rect, const cv::Rect &vis,
+                const bool smooth) {
+    if (smooth)
+      linear<CN, DCN>(src, src_roi, dst, dst_rect, vis);
+    else
+      nearest<CN, DCN>(src, src_roi, dst, dst_rect, vis);
+  }
+
+public:
+  /* Returns false without touching dst for layouts other than 8 bit 1, 3
+   * or 4 channels, which are left to cv::resize. A 4 channel dst also takes
+   * a 1 or 3 channel src, for drawing straight into a display's BGRX
+   * image.
+   */
+  bool blit(const cv::Mat &src, const cv::Rect &src_roi, cv::Mat &dst,
+            const cv::Rect &dst_rect, const bool smooth = false) {
+    if ((src.depth() != CV_8U) || (dst.depth() != CV_8U))
+      return false;
+    const int cn = src.channels();
+    const int dcn = dst.channels();
+    if (((cn != 1) && (cn != 3) && (cn != 4)) || ((dcn != cn) && (dcn != 4)))
+      return false;
+    const cv::Rect vis = dst_rect & cv::Rect(0, 0, dst.cols, dst.rows);
+    if ((vis.width <= 0) || (vis.height <= 0) || (src_roi.width <= 0) ||
+        (src_roi.height <= 0))
+      return true;
+
+    // only allocates when the window gets wider than it has been
+    xofs.resize(vis.width);
+    xofs1.resize(vis.width);
+    xw.resize(vis.width);
+    if (dcn == 1)
+      resample<1, 1>(src, src_roi, dst, dst_rect, vis, smooth);
+    else if (dcn == 3)
+      resample<3, 3>(src, src_roi, dst, dst_rect, vis, smooth);
+    else if (cn == 1)
+      resample<1, 4>(src, src_roi, dst, dst_rect, vis, smooth);
+    else if (cn == 3)
+      resample<3, 4>(src, src_roi, dst, dst_rect, vis, smooth);
+    else
+      resample<4, 4>(src, src_roi, dst, dst_rect, vis, smooth);
+    return true;
+  }
+};
+
+#endif // VIMAJ_BLIT_H
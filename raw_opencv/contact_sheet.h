@@ -0,0 +1,351 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIMAJ_CONTACT_SHEET_H
+#define VIMAJ_CONTACT_SHEET_H
+
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/bind/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/thread.hpp>
+
+#include "images.h"
+
+struct ContactSheetConfig {
+  // each image is fit into a cell this size
+  cv::Size cell;
+  float max_scale;
+  int cols;
+  int rows;
+  // sheets are written to sheet_prefix_0000.jpg and so on, empty for none
+  std::string sheet_prefix;
+  // each thumbnail written under here mirroring the source path, empty for
+  // none
+  std::string thumbnails_dir;
+  // the file name under each cell
+  bool labels;
+  int quality;
+  int threads;
+
+  ContactSheetConfig()
+      : cell(256, 256), max_scale(1.0), cols(8), rows(6), labels(true),
+        quality(90), threads(1) {}
+};
+
+/* Decode images into thumbnails and tile them into contact sheets in the
+ * order they are added, on as many threads as configured and without a
+ * window. add blocks while too many images are in flight, so only a few
+ * sheets are ever in memory however many images there are. Each sheet is
+ * written by whichever thread fills its last cell.
+ */
+class ContactSheets {
+  ContactSheetConfig config;
+  int per_sheet;
+  // images allowed between the oldest unfinished one and the newest added
+  int max_in_flight;
+
+  boost::thread_group workers;
+  boost::mutex mutex;
+  boost::condition_variable work_cond;
+  boost::condition_variable space_cond;
+  std::deque<std::pair<int, std::string> > queue;
+  bool adding;
+  int num_added;
+  int num_done;
+  int num_failed;
+  int num_sheets;
+
+  struct Sheet {
+    cv::Mat im;
+    int filled;
+  };
+  std::map<int, Sheet> sheets;
+
+  boost::posix_time::ptime t0;
+
+  double getElapsed() const {
+    return (boost::posix_time::microsec_clock::universal_time() - t0)
+               .total_microseconds() /
+           1e6;
+  }
+
+  std::string getThumbnailName(const std::string &name) const {
+    std::string rel = name;
+    while (rel.compare(0, 2, "./") == 0)
+      rel.erase(0, 2);
+    while (!rel.empty() && (rel[0] == '/'))
+      rel.erase(0, 1);
+    return config.thumbnails_dir + "/" + rel.substr(0, rel.rfind('.')) +
+           ".jpg";
+  }
+
+  bool writeImage(const std::string &name, const cv::Mat &im) {
+    std::vector<int> params;
+    params.push_back(cv::IMWRITE_JPEG_QUALITY);
+    params.push_back(config.quality);
+    try {
+      const boost::filesystem::path parent =
+          boost::filesystem::path(name).parent_path();
+      if (!parent.empty())
+        boost::filesystem::create_directories(parent);
+    } catch (const boost::filesystem::filesystem_error &ex) {
+      LOG(ERROR) << CLERR << ex.what() << CLNRM;
+      return false;
+    }
+    STAGE_TIMER("export");
+    return cv::imwrite(name, im, params);
+  }
+
+  int getNumDone() {
+    boost::mutex::scoped_lock l(mutex);
+    return num_done;
+  }
+
+  void writeSheet(const int num, const cv::Mat &im, const int filled) {
+    std::stringstream name;
+    name << config.sheet_prefix << "_" << std::setfill('0') << std::setw(4)
+         << num << ".jpg";
+    if (!writeImage(name.str(), im)) {
+      LOG(ERROR) << CLERR << "couldn't write " << CLNRM << name.str();
+      return;
+    }
+    LOG(INFO) << "wrote " << name.str() << " with " << filled << " images, "
+              << getNumDone() / std::max(getElapsed(), 1e-3) << " images/s";
+  }
+
+  // the cell at index within its sheet, the sheet image created if needed,
+  // the fill count may already be ahead of it from cells that failed
+  cv::Mat getCell(const int index, const int type) {
+    boost::mutex::scoped_lock l(mutex);
+    Sheet &sheet = sheets[index / per_sheet];
+    if (sheet.im.empty())
+      sheet.im = cv::Mat(config.cell.height * config.rows,
+                         config.cell.width * config.cols, type,
+                         cv::Scalar::all(0));
+    const int i = index % per_sheet;
+    return sheet.im(cv::Rect((i % config.cols) * config.cell.width,
+                             (i / config.cols) * config.cell.height,
+                             config.cell.width, config.cell.height));
+  }
+
+  void placeThumbnail(const int index, const std::string &name,
+                      const cv::Mat &thumb) {
+    cv::Mat cell = getCell(index, thumb.type());
+    if (cell.type() != thumb.type())
+      return;
+    // centered, the label over the bottom
+    const cv::Rect roi((cell.cols - thumb.cols) / 2,
+                       (cell.rows - thumb.rows) / 2, thumb.cols, thumb.rows);
+    cv::Mat dst = cell(roi);
+    thumb.copyTo(dst);
+    if (config.labels) {
+      const std::string leaf =
+          boost::filesystem::path(name).filename().string();
+      cv::putText(cell, leaf, cv::Point(4, cell.rows - 6), 1, 0.8,
+                  cv::Scalar::all(0), 3);
+      cv::putText(cell, leaf, cv::Point(4, cell.rows - 6), 1, 0.8,
+                  cv::Scalar::all(255));
+    }
+  }
+
+  // count the cell as filled, writing the sheet if it was the last one
+  void finishCell(const int index) {
+    if (per_sheet == 0)
+      return;
+    const int num = index / per_sheet;
+    cv::Mat im;
+    int filled = 0;
+    {
+      boost::mutex::scoped_lock l(mutex);
+      Sheet &sheet = sheets[num];
+      filled = ++sheet.filled;
+      if (filled < per_sheet)
+        return;
+      im = sheet.im;
+      sheets.erase(num);
+      num_sheets++;
+    }
+    if (!im.empty())
+      writeSheet(num, im, filled);
+  }
+
+  void workerThread() {
+    while (true) {
+      std::pair<int, std::string> item;
+      {
+        boost::mutex::scoped_lock l(mutex);
+        while (adding && queue.empty())
+          work_cond.wait(l);
+        if (queue.empty())
+          return;
+        item = queue.front();
+        queue.pop_front();
+      }
+
+      cv::Mat orig;
+      cv::Mat thumb;
+      cv::Size full_size;
+      cv::Size header_size;
+      bool is_jpeg = false;
+      Images::decodeScaled(item.second, orig, thumb, full_size, NULL,
+                           header_size, is_jpeg, config.cell,
+                           config.max_scale);
+      orig.release();
+      if (thumb.empty()) {
+        LOG(WARNING) << " not an image? " << item.second;
+      } else {
+        if (!config.thumbnails_dir.empty()) {
+          const std::string out_name = getThumbnailName(item.second);
+          if (!writeImage(out_name, thumb))
+            LOG(ERROR) << CLERR << "couldn't write " << CLNRM << out_name;
+        }
+        if (per_sheet > 0)
+          placeThumbnail(item.first, item.second, thumb);
+      }
+      finishCell(item.first);
+
+      {
+        boost::mutex::scoped_lock l(mutex);
+        num_done++;
+        if (thumb.empty())
+          num_failed++;
+      }
+      space_cond.notify_all();
+    }
+  }
+
+public:
+  ContactSheets(const ContactSheetConfig &config)
+      : config(config), adding(true), num_added(0), num_done(0),
+        num_failed(0), num_sheets(0) {
+    per_sheet = this->config.sheet_prefix.empty()
+                    ? 0
+                    : this->config.cols * this->config.rows;
+    max_in_flight = std::max(4 * std::max(config.threads, 1), per_sheet);
+    t0 = boost::posix_time::microsec_clock::universal_time();
+    for (int i = 0; i < std::max(config.threads, 1); ++i)
+      workers.create_thread(boost::bind(&ContactSheets::workerThread, this));
+  }
+
+  ~ContactSheets() { finish(); }
+
+  void add(const std::string &name) {
+    {
+      boost::mutex::scoped_lock l(mutex);
+      while (num_added - num_done >= max_in_flight)
+        space_cond.wait(l);
+      queue.push_back(std::make_pair(num_added++, name));
+    }
+    work_cond.notify_one();
+  }
+
+  // waits for everything added and writes the last partly filled sheet
+  void finish() {
+    {
+      boost::mutex::scoped_lock l(mutex);
+      if (!adding)
+        return;
+      adding = false;
+    }
+    work_cond.notify_all();
+    workers.join_all();
+
+    for (std::map<int, Sheet>::iterator it = sheets.begin();
+         it != sheets.end(); ++it) {
+      if (!it->second.im.empty())
+        writeSheet(it->first, it->second.im, it->second.filled);
+      num_sheets++;
+    }
+    sheets.clear();
+
+    const double elapsed = getElapsed();
+    LOG(INFO) << num_done << " images (" << num_failed << " failed) into "
+              << num_sheets << " sheets in " << elapsed << " s, "
+              << num_done / std::max(elapsed, 1e-3) << " images/s with "
+              << config.threads << " threads";
+  }
+
+  int getNumFailed() {
+    boost::mutex::scoped_lock l(mutex);
+    return num_failed;
+  }
+
+  /* Add every image in dir in natural order, then those in each
+   * subdirectory if recursive.
+   */
+  bool addDir(const std::string &dir, const bool recursive) {
+    std::vector<std::string> names;
+    std::vector<std::string> subdirs;
+    try {
+      boost::filesystem::directory_iterator end_itr;
+      for (boost::filesystem::directory_iterator itr(dir); itr != end_itr;
+           ++itr) {
+        const std::string name = itr->path().string();
+        if (is_directory(itr->symlink_status()))
+          subdirs.push_back(name);
+        else if (isImageName(name))
+          names.push_back(name);
+      }
+    } catch (const boost::filesystem::filesystem_error &ex) {
+      LOG(ERROR) << CLERR << ex.what() << CLNRM;
+      return false;
+    }
+    std::sort(names.begin(), names.end(), naturalLess);
+    for (size_t i = 0; i < names.size(); ++i)
+      add(names[i]);
+    if (recursive) {
+      std::sort(subdirs.begin(), subdirs.end(), naturalLess);
+      for (size_t i = 0; i < subdirs.size(); ++i)
+        addDir(subdirs[i], recursive);
+    }
+    return true;
+  }
+
+  // a file of image paths one per line, - for stdin
+  bool addList(const std::string &list) {
+    std::ifstream file;
+    std::istream *in = &std::cin;
+    if (list != "-") {
+      file.open(list.c_str());
+      if (!file) {
+        LOG(ERROR) << CLERR << "can't read list " << CLNRM << list;
+        return false;
+      }
+      in = &file;
+    }
+    std::string line;
+    while (std::getline(*in, line)) {
+      if (isImageName(line))
+        add(line);
+    }
+    return true;
+  }
+};
+
+#endif // VIMAJ_CONTACT_SHEET_H
@@ -0,0 +1,397 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIMAJ_DISPLAY_H
+#define VIMAJ_DISPLAY_H
+
+#include <deque>
+#include <string>
+#include <unistd.h>
+
+#include <boost/thread.hpp>
+
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <glog/logging.h>
+
+#include "stats.h"
+
+#ifdef VIMAJ_HAVE_XSHM
+#include <poll.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#endif
+
+/* Where rendered frames are shown and keys come from. Each backend times
+ * its presents as its own stage.
+ */
+class DisplayBackend {
+public:
+  virtual ~DisplayBackend() {}
+  virtual const char *getName() const = 0;
+  virtual void show(const cv::Mat &im) = 0;
+  /* The image the next show() will present as a CV_8UC4 Mat to draw that
+   * frame into, empty if the backend has none or it isn't free yet. From
+   * another thread than show(), which doesn't present anything while it is
+   * held, until releaseFrame().
+   */
+  virtual cv::Mat acquireFrame() { return cv::Mat(); }
+  virtual void releaseFrame() {}
+  // the next key pressed within ms, -1 if none
+  virtual int waitKey(const int ms) = 0;
+};
+
+// a HighGUI window, imshow copies each frame into the window's own buffer
+class HighguiDisplay : public DisplayBackend {
+public:
+  HighguiDisplay() { cv::namedWindow("frames"); }
+  ~HighguiDisplay() { cv::destroyWindow("frames"); }
+
+  const char *getName() const { return "highgui"; }
+
+  void show(const cv::Mat &im) {
+    STAGE_TIMER("present_highgui");
+    cv::imshow("frames", im);
+  }
+
+  int waitKey(const int ms) { return cv::waitKey(ms); }
+};
+
+/* Shows nothing, for measuring everything but the display, under Xvfb or
+ * without any X server. Types each of keys once the frame for the one
+ * before has been shown, then q.
+ */
+class NullDisplay : public DisplayBackend {
+  std::string keys;
+  size_t next_key;
+  bool shown;
+
+public:
+  NullDisplay(const std::string &keys) : keys(keys), next_key(0), shown(false) {}
+
+  const char *getName() const { return "null"; }
+
+  void show(const cv::Mat &im) {
+    STAGE_TIMER("present_null");
+    shown = !im.empty();
+  }
+
+  int waitKey(const int ms) {
+    if (!shown) {
+      usleep(ms * 1000);
+      return -1;
+    }
+    shown = false;
+    if (next_key < keys.size())
+      return keys[next_key++];
+    return 'q';
+  }
+};
+
+#ifdef VIMAJ_HAVE_XSHM
+/* A plain X window presented from shared memory images with
+ * XShmPutImage, so the server reads the pixels straight from this process
+ * without them going through the socket. Frames are drawn straight into
+ * the shared image through acquireFrame, others converted to the server's
+ * BGRX layout in the one pass that writes them into it. Two images are
+ * alternated so the next frame can be written while the server may still
+ * be reading the last one.
+ * TBD only 24 bit TrueColor visuals, which is nearly everything now.
+ */
+class XShmDisplay : public DisplayBackend {
+  ::Display *x;
+  Window win;
+  GC gc;
+  Atom wm_delete;
+  int completion_type;
+  cv::Size sz;
+  XShmSegmentInfo shm[2];
+  XImage *images[2];
+  // for pending, cur, last and drawing, acquireFrame is called from the
+  // render thread
+  boost::mutex mutex;
+  // the server hasn't finished reading it
+  bool pending[2];
+  int cur;
+  // the last one put, for redrawing on expose
+  int last;
+  // images[cur] is acquired
+  bool drawing;
+  std::deque<int> keys;
+
+  void handleEvent(XEvent &event) {
+    boost::mutex::scoped_lock l(mutex);
+    if (event.type == completion_type) {
+      const XShmCompletionEvent &done = (const XShmCompletionEvent &)event;
+      for (int i = 0; i < 2; ++i) {
+        if (done.shmseg == shm[i].shmseg)
+          pending[i] = false;
+      }
+    } else if (event.type == KeyPress) {
+      char buf[8];
+      KeySym sym;
+      const int len = XLookupString(&event.xkey, buf, sizeof(buf), &sym, NULL);
+      if (len > 0)
+        keys.push_back((unsigned char)buf[0]);
+    } else if ((event.type == Expose) && (last >= 0) && !pending[last]) {
+      XShmPutImage(x, win, gc, images[last], 0, 0, 0, 0, sz.width, sz.height,
+                   True);
+      pending[last] = true;
+    } else if ((event.type == ClientMessage) &&
+               ((Atom)event.xclient.data.l[0] == wm_delete)) {
+      // closing the window quits like q does
+      keys.push_back('q');
+    }
+  }
+
+  // set by onXError, which is only installed while attaching
+  static bool &getXFailed() {
+    static bool failed = false;
+    return failed;
+  }
+
+  // the default handler exits, a failed attach falls back to highgui instead
+  static int onXError(::Display *, XErrorEvent *) {
+    getXFailed() = true;
+    return 0;
+  }
+
+  /* Create images[i] in a new shared memory segment and have the server
+   * attach it, false with nothing left allocated if any step fails. The
+   * segment is marked for removal as soon as both sides have it attached,
+   * so it can't outlive the process.
+   */
+  bool attachImage(const int i, Visual *visual, const int depth) {
+    images[i] = XShmCreateImage(x, visual, depth, ZPixmap, NULL, &shm[i],
+                                sz.width, sz.height);
+    if ((images[i] == NULL) || (images[i]->bits_per_pixel != 32)) {
+      LOG(WARNING) << "can't make a 32 bit shared image";
+      if (images[i] != NULL)
+        XDestroyImage(images[i]);
+      images[i] = NULL;
+      return false;
+    }
+    shm[i].shmid = shmget(IPC_PRIVATE,
+                          images[i]->bytes_per_line * images[i]->height,
+                          IPC_CREAT | 0600);
+    shm[i].shmaddr = (shm[i].shmid < 0)
+                         ? (char *)-1
+                         : (char *)shmat(shm[i].shmid, NULL, 0);
+    bool ok = (shm[i].shmaddr != (char *)-1);
+    if (ok) {
+      images[i]->data = shm[i].shmaddr;
+      shm[i].readOnly = False;
+      getXFailed() = false;
+      XErrorHandler old_handler = XSetErrorHandler(onXError);
+      XShmAttach(x, &shm[i]);
+      // any error from the attach arrives by now
+      XSync(x, False);
+      XSetErrorHandler(old_handler);
+      ok = !getXFailed();
+    }
+    if (shm[i].shmid >= 0)
+      shmctl(shm[i].shmid, IPC_RMID, NULL);
+    if (!ok) {
+      LOG(WARNING) << "can't attach shared memory";
+      if (shm[i].shmaddr != (char *)-1)
+        shmdt(shm[i].shmaddr);
+      images[i]->data = NULL;
+      XDestroyImage(images[i]);
+      images[i] = NULL;
+    }
+    return ok;
+  }
+
+  void release() {
+    for (int i = 0; i < 2; ++i) {
+      if (images[i] == NULL)
+        continue;
+      XShmDetach(x, &shm[i]);
+      // the data is the shared memory, not XDestroyImage's to free
+      images[i]->data = NULL;
+      XDestroyImage(images[i]);
+      shmdt(shm[i].shmaddr);
+      images[i] = NULL;
+    }
+    if (gc != NULL)
+      XFreeGC(x, gc);
+    if (win != 0)
+      XDestroyWindow(x, win);
+    XCloseDisplay(x);
+    x = NULL;
+  }
+
+public:
+  XShmDisplay(const cv::Size sz)
+      : x(NULL), win(0), gc(NULL), completion_type(-1), sz(sz), cur(0),
+        last(-1), drawing(false) {
+    images[0] = images[1] = NULL;
+    pending[0] = pending[1] = false;
+    x = XOpenDisplay(NULL);
+    if (x == NULL) {
+      LOG(WARNING) << "can't open the X display";
+      return;
+    }
+    const int screen = DefaultScreen(x);
+    Visual *visual = DefaultVisual(x, screen);
+    const int depth = DefaultDepth(x, screen);
+    if (!XShmQueryExtension(x) || (depth != 24)) {
+      LOG(WARNING) << "no MIT-SHM or not a 24 bit display";
+      XCloseDisplay(x);
+      x = NULL;
+      return;
+    }
+    completion_type = XShmGetEventBase(x) + ShmCompletion;
+
+    win = XCreateSimpleWindow(x, RootWindow(x, screen), 0, 0, sz.width,
+                              sz.height, 0, BlackPixel(x, screen),
+                              BlackPixel(x, screen));
+    XStoreName(x, win, "frames");
+    XSelectInput(x, win, KeyPressMask | ExposureMask);
+    wm_delete = XInternAtom(x, "WM_DELETE_WINDOW", False);
+    XSetWMProtocols(x, win, &wm_delete, 1);
+    gc = XCreateGC(x, win, 0, NULL);
+
+    for (int i = 0; i < 2; ++i) {
+      // isOpen is false after this, so createDisplay falls back
+      if (!attachImage(i, visual, depth)) {
+        release();
+        return;
+      }
+    }
+    XMapWindow(x, win);
+    XSync(x, False);
+  }
+
+  ~XShmDisplay() {
+    if (x != NULL)
+      release();
+  }
+
+  bool isOpen() const { return x != NULL; }
+
+  const char *getName() const { return "xshm"; }
+
+  cv::Mat acquireFrame() {
+    boost::mutex::scoped_lock l(mutex);
+    if (pending[cur])
+      return cv::Mat();
+    drawing = true;
+    return cv::Mat(sz, CV_8UC4, images[cur]->data, images[cur]->bytes_per_line);
+  }
+
+  void releaseFrame() {
+    boost::mutex::scoped_lock l(mutex);
+    drawing = false;
+  }
+
+  void show(const cv::Mat &im) {
+    STAGE_TIMER("present_xshm");
+    // the server may still be reading the one before last
+    while (true) {
+      {
+        boost::mutex::scoped_lock l(mutex);
+        if (!pending[cur])
+          break;
+      }
+      XEvent event;
+      XNextEvent(x, &event);
+      handleEvent(event);
+    }
+    boost::mutex::scoped_lock l(mutex);
+    // a newer frame is being drawn into it, which replaces this one anyway
+    if (drawing)
+      return;
+    XImage *image = images[cur];
+    if (im.data != (uchar *)image->data) {
+      // rendered ahead or a grid, not drawn into it
+      cv::Mat dst(sz, CV_8UC4, image->data, image->bytes_per_line);
+      const cv::Rect rect = cv::Rect(0, 0, im.cols, im.rows) &
+                            cv::Rect(0, 0, sz.width, sz.height);
+      cv::Mat dst_roi = dst(rect);
+      if (rect.size() != sz)
+        dst.setTo(cv::Scalar::all(0));
+      if (im.channels() == 3)
+        cv::cvtColor(im(rect), dst_roi, cv::COLOR_BGR2BGRA);
+      else if (im.channels() == 1)
+        cv::cvtColor(im(rect), dst_roi, cv::COLOR_GRAY2BGRA);
+      else
+        im(rect).copyTo(dst_roi);
+    }
+    XShmPutImage(x, win, gc, image, 0, 0, 0, 0, sz.width, sz.height, True);
+    XFlush(x);
+    pending[cur] = true;
+    last = cur;
+    cur = 1 - cur;
+  }
+
+  int waitKey(const int ms) {
+    if (keys.empty()) {
+      if (XPending(x) == 0) {
+        struct pollfd pfd;
+        pfd.fd = ConnectionNumber(x);
+        pfd.events = POLLIN;
+        poll(&pfd, 1, ms);
+      }
+      while (XPending(x) > 0) {
+        XEvent event;
+        XNextEvent(x, &event);
+        handleEvent(event);
+      }
+    }
+    if (keys.empty())
+      return -1;
+    const int key = keys.front();
+    keys.pop_front();
+    return key;
+  }
+};
+#endif
+
+/* highgui, xshm or null, falling back to highgui if the one asked for isn't
+ * available. null types keys.
+ */
+inline DisplayBackend *createDisplay(const std::string &name,
+                                     const cv::Size sz,
+                                     const std::string &keys) {
+  if (name == "null")
+    return new NullDisplay(keys);
+  if (name == "xshm") {
+#ifdef VIMAJ_HAVE_XSHM
+    XShmDisplay *display = new XShmDisplay(sz);
+    if (display->isOpen())
+      return display;
+    delete display;
+#else
+    LOG(WARNING) << "built without MIT-SHM";
+#endif
+    LOG(WARNING) << "using highgui instead of xshm";
+  } else if (name != "highgui") {
+    LOG(WARNING) << "unknown display " << name << ", using highgui";
+  }
+  return new HighguiDisplay();
+}
+
+#endif // VIMAJ_DISPLAY_H
@@ -0,0 +1,168 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIMAJ_EXIF_H
+#define VIMAJ_EXIF_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+// what the exif block of a jpeg says, read without decoding any pixels
+struct ExifInfo {
+  // 1 to 8 as in the tiff spec, 1 is upright
+  int orientation;
+  // the embedded preview jpeg, empty if there is none
+  std::vector<unsigned char> preview;
+  // when the picture was taken in seconds since the epoch, taking the
+  // camera clock as utc, 0 if not recorded
+  int64_t taken;
+
+  ExifInfo() : orientation(1), taken(0) {}
+};
+
+inline uint32_t exifGet16(const unsigned char *p, const bool le) {
+  return le ? (p[0] | (p[1] << 8)) : ((p[0] << 8) | p[1]);
+}
+
+inline uint32_t exifGet32(const unsigned char *p, const bool le) {
+  return le ? (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24))
+            : (((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+}
+
+// "YYYY:MM:DD HH:MM:SS" at offset, 0 if it isn't one
+inline int64_t parseExifDate(const unsigned char *b, const size_t len,
+                             const size_t offset) {
+  if ((offset >= len) || (len - offset < 19))
+    return 0;
+  const std::string date((const char *)b + offset, 19);
+  struct tm t;
+  memset(&t, 0, sizeof(t));
+  if (sscanf(date.c_str(), "%d:%d:%d %d:%d:%d", &t.tm_year, &t.tm_mon,
+             &t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec) != 6 ||
+      (t.tm_year < 1900))
+    return 0;
+  t.tm_year -= 1900;
+  t.tm_mon -= 1;
+  return timegm(&t);
+}
+
+/* Parse the tiff structure following "Exif\0\0" in an APP1 segment. The
+ * orientation is in the first ifd, the capture date in the exif ifd it
+ * points to and the preview is located by the second, offsets are from
+ * the start of the tiff header.
+ */
+inline bool parseExif(const unsigned char *b, const size_t len,
+                      ExifInfo &exif) {
+  if (len < 8)
+    return false;
+  bool le;
+  if ((b[0] == 'I') && (b[1] == 'I'))
+    le = true;
+  else if ((b[0] == 'M') && (b[1] == 'M'))
+    le = false;
+  else
+    return false;
+  if (exifGet16(b + 2, le) != 42)
+    return false;
+
+  uint32_t thumb_offset = 0;
+  uint32_t thumb_len = 0;
+  size_t exif_ifd = 0;
+  // the file's modification date in the first ifd, if there is no other
+  int64_t modified = 0;
+  size_t ifd = exifGet32(b + 4, le);
+  // the exif ifd is parsed last as n == 2
+  for (int n = 0; n < 3; ++n) {
+    if (n == 2)
+      ifd = exif_ifd;
+    if (ifd == 0)
+      continue;
+    if (ifd + 2 > len)
+      continue;
+    const size_t count = exifGet16(b + ifd, le);
+    if (ifd + 2 + count * 12 + 4 > len)
+      continue;
+    for (size_t i = 0; i < count; ++i) {
+      const unsigned char *e = b + ifd + 2 + i * 12;
+      const uint32_t tag = exifGet16(e, le);
+      // a short value is in the first two bytes of the value field
+      const uint32_t value = (exifGet16(e + 2, le) == 3) ? exifGet16(e + 8, le)
+                                                         : exifGet32(e + 8, le);
+      if ((n == 0) && (tag == 0x0112) && (value >= 1) && (value <= 8))
+        exif.orientation = value;
+      else if ((n == 0) && (tag == 0x8769))
+        exif_ifd = value;
+      else if ((n == 0) && (tag == 0x0132))
+        modified = parseExifDate(b, len, value);
+      else if ((n == 2) && (tag == 0x9003))
+        exif.taken = parseExifDate(b, len, value);
+      else if ((n == 1) && (tag == 0x0201))
+        thumb_offset = value;
+      else if ((n == 1) && (tag == 0x0202))
+        thumb_len = value;
+    }
+    ifd = exifGet32(b + ifd + 2 + count * 12, le);
+  }
+  if (exif.taken == 0)
+    exif.taken = modified;
+  if ((thumb_len > 0) && (thumb_offset < len) &&
+      (thumb_len <= len - thumb_offset))
+    exif.preview.assign(b + thumb_offset, b + thumb_offset + thumb_len);
+  return true;
+}
+
+// orientations 5 to 8 swap the axes
+inline cv::Size getOrientedSize(const cv::Size size, const int orientation) {
+  if (orientation >= 5)
+    return cv::Size(size.height, size.width);
+  return size;
+}
+
+// turn pixels stored as the sensor saw them upright
+inline void applyOrientation(const cv::Mat &src, cv::Mat &dst,
+                             const int orientation) {
+  cv::Mat tmp = src;
+  if (orientation >= 5)
+    cv::transpose(src, tmp);
+  switch (orientation) {
+  case 2:
+  case 6:
+    cv::flip(tmp, dst, 1);
+    break;
+  case 3:
+  case 7:
+    cv::flip(tmp, dst, -1);
+    break;
+  case 4:
+  case 8:
+    cv::flip(tmp, dst, 0);
+    break;
+  default:
+    dst = tmp;
+  }
+}
+
+#endif // VIMAJ_EXIF_H
@@ -0,0 +1,399 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIMAJ_EXPORT_QUEUE_H
+#define VIMAJ_EXPORT_QUEUE_H
+
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include <boost/bind/bind.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <glog/logging.h>
+
+#include "stats.h"
+
+struct ExportJob {
+  // where the pixels come from, replaced with what load returns if it is set
+  cv::Mat image;
+  boost::function<cv::Mat()> load;
+  // in image coordinates, or in the loaded image's if there is no image,
+  // empty for all of it
+  cv::Rect roi;
+  // trim roi to this width / height around its center, 0 to leave it
+  float aspect;
+  // the output is named after this
+  std::string source;
+  // filled in by push
+  std::string name;
+
+  ExportJob() : aspect(0.0) {}
+};
+
+struct ExportConfig {
+  // jpg, png or webp
+  std::string format;
+  // jpg and webp quality 0-100, png compression 0-9
+  int quality;
+  // next to the source image if empty
+  std::string dir;
+  int threads;
+
+  ExportConfig() : format("jpg"), quality(95), threads(1) {}
+};
+
+/* Crops are cut and encoded on background threads so the ui doesn't wait
+ * for them. Output names are the source's with a number appended, handed out
+ * when the job is pushed by counting up from the highest number already on
+ * disk. Each output directory is listed once, the first time anything is
+ * exported to it, outside the lock.
+ */
+class ExportQueue {
+  ExportConfig config;
+  std::vector<int> params;
+
+  boost::thread_group workers;
+  boost::mutex mutex;
+  boost::condition_variable cond;
+  // signalled when a job finishes, for waitIdle
+  boost::condition_variable idle_cond;
+  std::deque<ExportJob> jobs;
+  int busy;
+  bool run;
+  // the next free number for each stem in every output directory listed so
+  // far, keyed by directory then stem filename
+  std::map<std::string, std::map<std::string, int> > dir_nums;
+  int num_written;
+  int num_failed;
+
+  // the largest rect with the aspect ratio centered in roi
+  static cv::Rect fitAspect(const cv::Rect &roi, const float aspect) {
+    if ((aspect <= 0) || (roi.height == 0))
+      return roi;
+    cv::Rect fit = roi;
+    if ((float)roi.width / roi.height > aspect)
+      fit.width = roi.height * aspect;
+    else
+      fit.height = roi.width / aspect;
+    fit.x += (roi.width - fit.width) / 2;
+    fit.y += (roi.height - fit.height) / 2;
+    return fit;
+  }
+
+  static boost::filesystem::path getOutputDir(const std::string &stem) {
+    const boost::filesystem::path dir =
+        boost::filesystem::path(stem).parent_path();
+    return dir.empty() ? boost::filesystem::path(".") : dir;
+  }
+
+  // the next free number for every stem with numbered files in dir
+  static std::map<std::string, int>
+  listNums(const boost::filesystem::path &dir) {
+    std::map<std::string, int> nums;
+    try {
+      boost::filesystem::directory_iterator end_itr;
+      for (boost::filesystem::directory_iterator itr(dir); itr != end_itr;
+           ++itr) {
+        const std::string leaf = itr->path().stem().string();
+        const size_t under = leaf.rfind('_');
+        if ((under == std::string::npos) || (under + 1 == leaf.size()) ||
+            (leaf.find_first_not_of("0123456789", under + 1) !=
+             std::string::npos))
+          continue;
+        const int used = atoi(leaf.c_str() + under + 1);
+        int &num = nums[leaf.substr(0, under)];
+        num = std::max(num, used + 1);
+      }
+    } catch (const boost::filesystem::filesystem_error &ex) {
+      LOG(WARNING) << ex.what();
+    }
+    return nums;
+  }
+
+  std::string getStem(const std::string &source) const {
+    std::string stem = source.substr(0, source.rfind('.'));
+    if (!config.dir.empty())
+      stem = (boost::filesystem::path(config.dir) /
+              boost::filesystem::path(stem).filename())
+                 .string();
+    return stem;
+  }
+
+  // mutex must be held and the output directory of stem already listed
+  std::string allocateName(const std::string &stem) {
+    std::map<std::string, int> &nums = dir_nums[getOutputDir(stem).string()];
+    int &next = nums[boost::filesystem::path(stem).filename().string()];
+    const int num = std::max(next, 1000);
+    next = num + 1;
+    std::stringstream name;
+    name << stem << "_" << num << "." << config.format;
+    return name.str();
+  }
+
+  bool write(ExportJob &job) {
+    cv::Mat src = job.image;
+    cv::Rect roi = job.roi;
+    if (job.load) {
+      cv::Mat full = job.load();
+      if (!full.empty()) {
+        // the roi was picked on a smaller version
+        if (!src.empty() && (src.cols != full.cols)) {
+          const float sx = (float)full.cols / src.cols;
+          const float sy = (float)full.rows / src.rows;
+          roi = cv::Rect(roi.x * sx, roi.y * sy, roi.width * sx,
+                         roi.height * sy);
+        }
+        src = full;
+      }
+    }
+    if (src.empty())
+      return false;
+    if ((roi.width <= 0) || (roi.height <= 0))
+      roi = cv::Rect(0, 0, src.cols, src.rows);
+    roi = fitAspect(roi & cv::Rect(0, 0, src.cols, src.rows), job.aspect);
+    if ((roi.width <= 0) || (roi.height <= 0))
+      return false;
+
+    STAGE_TIMER("export");
+    return cv::imwrite(job.name, src(roi), params);
+  }
+
+  void workerThread() {
+    while (true) {
+      ExportJob job;
+      {
+        boost::mutex::scoped_lock l(mutex);
+        while (run && jobs.empty())
+          cond.wait(l);
+        // finish everything queued before stopping
+        if (jobs.empty())
+          return;
+        job = jobs.front();
+        jobs.pop_front();
+        busy++;
+      }
+      const bool ok = write(job);
+      if (ok)
+        LOG(INFO) << "wrote " << job.name;
+      else
+        LOG(ERROR) << "couldn't write " << job.name;
+      {
+        boost::mutex::scoped_lock l(mutex);
+        busy--;
+        if (ok)
+          num_written++;
+        else
+          num_failed++;
+      }
+      idle_cond.notify_all();
+    }
+  }
+
+public:
+  ExportQueue(const ExportConfig &config)
+      : config(config), busy(0), run(true), num_written(0), num_failed(0) {
+    if (this->config.format == "png") {
+      params.push_back(cv::IMWRITE_PNG_COMPRESSION);
+      params.push_back(std::min(config.quality, 9));
+    } else if (this->config.format == "webp") {
+      params.push_back(cv::IMWRITE_WEBP_QUALITY);
+      params.push_back(config.quality);
+    } else {
+      params.push_back(cv::IMWRITE_JPEG_QUALITY);
+      params.push_back(config.quality);
+    }
+    try {
+      if (!this->config.dir.empty())
+        boost::filesystem::create_directories(this->config.dir);
+    } catch (const boost::filesystem::filesystem_error &ex) {
+      LOG(ERROR) << ex.what();
+    }
+    for (int i = 0; i < std::max(config.threads, 1); ++i)
+      workers.create_thread(boost::bind(&ExportQueue::workerThread, this));
+  }
+
+  // writes everything queued first
+  ~ExportQueue() { finish(); }
+
+  void finish() {
+    {
+      boost::mutex::scoped_lock l(mutex);
+      run = false;
+    }
+    cond.notify_all();
+    workers.join_all();
+  }
+
+  // returns the name it will be written to
+  std::string push(ExportJob job) {
+    const std::string stem = getStem(job.source);
+    const boost::filesystem::path dir = getOutputDir(stem);
+    bool listed;
+    {
+      boost::mutex::scoped_lock l(mutex);
+      listed = dir_nums.count(dir.string()) > 0;
+    }
+    // list a new directory without holding up the workers, if two pushes
+    // race to list it the higher numbers are kept
+    std::map<std::string, int> nums;
+    if (!listed)
+      nums = listNums(dir);
+    {
+      boost::mutex::scoped_lock l(mutex);
+      if (!listed) {
+        std::map<std::string, int> &dst = dir_nums[dir.string()];
+        for (std::map<std::string, int>::const_iterator it = nums.begin();
+             it != nums.end(); ++it)
+          dst[it->first] = std::max(dst[it->first], it->second);
+      }
+      job.name = allocateName(stem);
+      jobs.push_back(job);
+    }
+    cond.notify_one();
+    return job.name;
+  }
+
+  std::string push(const std::string &source, const cv::Mat &image,
+                   const cv::Rect &roi,
+                   const boost::function<cv::Mat()> &load =
+                       boost::function<cv::Mat()>(),
+                   const float aspect = 0.0) {
+    ExportJob job;
+    job.source = source;
+    job.image = image;
+    job.roi = roi;
+    job.load = load;
+    job.aspect = aspect;
+    return push(job);
+  }
+
+  void waitIdle() {
+    boost::mutex::scoped_lock l(mutex);
+    while (!jobs.empty() || (busy > 0))
+      idle_cond.wait(l);
+  }
+
+  int getNumWritten() {
+    boost::mutex::scoped_lock l(mutex);
+    return num_written;
+  }
+  int getNumFailed() {
+    boost::mutex::scoped_lock l(mutex);
+    return num_failed;
+  }
+
+  static cv::Mat readImage(const std::string &name) {
+    STAGE_TIMER("imread");
+    return cv::imread(name);
+  }
+
+  /* Reads the file the first time any of the jobs cropping it loads it and
+   * hands the others the same image, which is freed with the last job.
+   */
+  class SharedRead {
+    std::string name;
+    boost::mutex mutex;
+    cv::Mat im;
+    bool done;
+
+  public:
+    SharedRead(const std::string &name) : name(name), done(false) {}
+
+    cv::Mat get() {
+      boost::mutex::scoped_lock l(mutex);
+      if (!done) {
+        im = readImage(name);
+        done = true;
+      }
+      return im;
+    }
+  };
+
+  /* Queue every crop in a list with lines of
+   *   image_path x y width height [aspect]
+   * in full resolution pixels, a width or height of 0 for the whole image.
+   * Blank lines and lines starting with # are skipped. The crops of a file
+   * are queued together and share one decode of it. Returns the number
+   * queued, or -1 if the list can't be read.
+   */
+  int pushCropList(const std::string &list) {
+    std::ifstream file;
+    std::istream *in = &std::cin;
+    if (list != "-") {
+      file.open(list.c_str());
+      if (!file) {
+        LOG(ERROR) << "can't read crop list " << list;
+        return -1;
+      }
+      in = &file;
+    }
+    // grouped by file so each is decoded once for all its crops
+    std::map<std::string, std::vector<ExportJob> > by_file;
+    int line_num = 0;
+    std::string line;
+    while (std::getline(*in, line)) {
+      line_num++;
+      if (line.empty() || (line[0] == '#'))
+        continue;
+      std::stringstream ss(line);
+      std::string name;
+      cv::Rect roi;
+      float aspect = 0.0;
+      if (!(ss >> name >> roi.x >> roi.y >> roi.width >> roi.height)) {
+        LOG(WARNING) << list << ":" << line_num << " bad crop " << line;
+        continue;
+      }
+      ss >> aspect;
+      ExportJob job;
+      job.source = name;
+      job.roi = roi;
+      job.aspect = aspect;
+      by_file[name].push_back(job);
+    }
+    int num = 0;
+    for (std::map<std::string, std::vector<ExportJob> >::iterator it =
+             by_file.begin();
+         it != by_file.end(); ++it) {
+      const boost::shared_ptr<SharedRead> read(new SharedRead(it->first));
+      for (size_t i = 0; i < it->second.size(); ++i) {
+        ExportJob &job = it->second[i];
+        job.load = boost::bind(&SharedRead::get, read);
+        push(job);
+        num++;
+      }
+    }
+    return num;
+  }
+};
+
+#endif // VIMAJ_EXPORT_QUEUE_H
@@ -0,0 +1,324 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIMAJ_FILE_INDEX_H
+#define VIMAJ_FILE_INDEX_H
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/thread.hpp>
+
+#include "opencv2/core.hpp"
+
+#include <glog/logging.h>
+
+// for naming the on disk caches after what they hold
+inline uint64_t fnv1a(const std::string &str) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < str.size(); ++i) {
+    hash ^= (unsigned char)str[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+struct IndexedFile {
+  std::string name;
+  // what size and mtime the header fields were read at, 0 if not yet
+  uint64_t size;
+  int64_t mtime;
+  int32_t width;
+  int32_t height;
+  uint8_t is_jpeg;
+  // exif capture time in seconds, 0 if none
+  int64_t taken;
+
+  IndexedFile()
+      : size(0), mtime(0), width(0), height(0), is_jpeg(0), taken(0) {}
+  bool operator<(const IndexedFile &other) const { return name < other.name; }
+};
+
+// the image files and subdirectories of one directory
+struct IndexedDir {
+  int64_t mtime;
+  std::vector<std::string> subdirs;
+  // sorted by name
+  std::vector<IndexedFile> files;
+
+  IndexedDir() : mtime(0) {}
+};
+
+/* The directory listings of the last run along with the image header sizes
+ * and capture times found then. A directory's mtime only changes when
+ * entries are added, removed or renamed in it, so while it stays the same
+ * the listing can be reused without reading the directory. Written out
+ * whole once the scan finishes, so quitting early still keeps the
+ * listings, and again when loading ends for the header fields read since.
+ */
+class FileIndex {
+  boost::mutex mutex;
+  // empty if not in use
+  std::string path;
+  std::map<std::string, IndexedDir> old_dirs;
+  std::map<std::string, IndexedDir> dirs;
+
+  static void writeString(std::ostream &out, const std::string &str) {
+    const uint32_t len = str.size();
+    out.write((const char *)&len, sizeof(len));
+    out.write(str.data(), len);
+  }
+
+  template <typename T> static void writeValue(std::ostream &out, const T v) {
+    out.write((const char *)&v, sizeof(v));
+  }
+
+  // reads from a whole file in memory, false past the end
+  class Reader {
+    const std::string &buf;
+    size_t pos;
+
+  public:
+    Reader(const std::string &buf, const size_t pos) : buf(buf), pos(pos) {}
+    bool done() const { return pos >= buf.size(); }
+
+    template <typename T> bool read(T &v) {
+      if (pos + sizeof(v) > buf.size())
+        return false;
+      memcpy(&v, buf.data() + pos, sizeof(v));
+      pos += sizeof(v);
+      return true;
+    }
+
+    bool read(std::string &str) {
+      uint32_t len;
+      if (!read(len) || (pos + len > buf.size()))
+        return false;
+      str.assign(buf.data() + pos, len);
+      pos += len;
+      return true;
+    }
+  };
+
+  bool load() {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in)
+      return false;
+    std::stringstream ss;
+    ss << in.rdbuf();
+    const std::string buf = ss.str();
+    if ((buf.size() < 8) || (buf.compare(0, 8, "VIMAJIX2") != 0))
+      return false;
+
+    Reader reader(buf, 8);
+    while (!reader.done()) {
+      std::string dir;
+      IndexedDir listing;
+      uint32_t num_subdirs;
+      if (!reader.read(dir) || !reader.read(listing.mtime) ||
+          !reader.read(num_subdirs))
+        return false;
+      listing.subdirs.resize(num_subdirs);
+      for (uint32_t i = 0; i < num_subdirs; ++i) {
+        if (!reader.read(listing.subdirs[i]))
+          return false;
+      }
+      uint32_t num_files;
+      if (!reader.read(num_files))
+        return false;
+      listing.files.resize(num_files);
+      for (uint32_t i = 0; i < num_files; ++i) {
+        IndexedFile &file = listing.files[i];
+        if (!reader.read(file.name) || !reader.read(file.size) ||
+            !reader.read(file.mtime) || !reader.read(file.width) ||
+            !reader.read(file.height) || !reader.read(file.is_jpeg) ||
+            !reader.read(file.taken))
+          return false;
+      }
+      IndexedDir &old = old_dirs[dir];
+      old.mtime = listing.mtime;
+      old.subdirs.swap(listing.subdirs);
+      old.files.swap(listing.files);
+    }
+    return true;
+  }
+
+  IndexedFile *findFile(const std::string &name) {
+    const size_t slash = name.rfind('/');
+    if (slash == std::string::npos)
+      return NULL;
+    const std::string dir = (slash == 0) ? "/" : name.substr(0, slash);
+    std::map<std::string, IndexedDir>::iterator it = dirs.find(dir);
+    if (it == dirs.end())
+      return NULL;
+    IndexedFile key;
+    key.name = name.substr(slash + 1);
+    std::vector<IndexedFile> &files = it->second.files;
+    std::vector<IndexedFile>::iterator file =
+        std::lower_bound(files.begin(), files.end(), key);
+    if ((file == files.end()) || (file->name != key.name))
+      return NULL;
+    return &(*file);
+  }
+
+public:
+  // source identifies the set of images, the index goes in cache_dir
+  bool open(const std::string &cache_dir, const std::string &source) {
+    try {
+      boost::filesystem::create_directories(cache_dir);
+    } catch (const boost::filesystem::filesystem_error &ex) {
+      LOG(WARNING) << "no file index: " << ex.what();
+      return false;
+    }
+    std::stringstream name;
+    name << cache_dir << "/" << std::hex << fnv1a(source) << ".index";
+    boost::mutex::scoped_lock l(mutex);
+    path = name.str();
+    if (!load()) {
+      old_dirs.clear();
+      LOG(INFO) << "new file index " << path;
+    } else {
+      LOG(INFO) << "file index " << path << " has " << old_dirs.size()
+                << " directories";
+    }
+    return true;
+  }
+
+  static bool dirMtime(const std::string &dir, int64_t &mtime) {
+    struct stat st;
+    if ((stat(dir.c_str(), &st) != 0) || !S_ISDIR(st.st_mode))
+      return false;
+    mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return true;
+  }
+
+  // the listing of dir from the last run if it hasn't changed since
+  bool getUnchanged(const std::string &dir, const int64_t mtime,
+                    IndexedDir &listing) {
+    boost::mutex::scoped_lock l(mutex);
+    std::map<std::string, IndexedDir>::const_iterator it = old_dirs.find(dir);
+    if ((it == old_dirs.end()) || (it->second.mtime != mtime))
+      return false;
+    listing = it->second;
+    return true;
+  }
+
+  // a new listing, keeping what was known about files already there
+  void setDir(const std::string &dir, const IndexedDir &listing) {
+    boost::mutex::scoped_lock l(mutex);
+    if (path.empty())
+      return;
+    IndexedDir &cur = dirs[dir];
+    cur = listing;
+    std::map<std::string, IndexedDir>::const_iterator it = old_dirs.find(dir);
+    if (it == old_dirs.end())
+      return;
+    const std::vector<IndexedFile> &old_files = it->second.files;
+    for (size_t i = 0; i < cur.files.size(); ++i) {
+      std::vector<IndexedFile>::const_iterator old = std::lower_bound(
+          old_files.begin(), old_files.end(), cur.files[i]);
+      if ((old != old_files.end()) && (old->name == cur.files[i].name))
+        cur.files[i] = *old;
+    }
+  }
+
+  // the header fields recorded for a file, if it hasn't changed since
+  bool lookupFile(const std::string &name, const uint64_t size,
+                  const int64_t mtime, cv::Size &header_size, bool &is_jpeg,
+                  int64_t &taken) {
+    boost::mutex::scoped_lock l(mutex);
+    const IndexedFile *file = findFile(name);
+    if ((file == NULL) || (file->width == 0) || (file->size != size) ||
+        (file->mtime != mtime))
+      return false;
+    header_size = cv::Size(file->width, file->height);
+    is_jpeg = file->is_jpeg;
+    taken = file->taken;
+    return true;
+  }
+
+  void updateFile(const std::string &name, const uint64_t size,
+                  const int64_t mtime, const cv::Size header_size,
+                  const bool is_jpeg, const int64_t taken) {
+    boost::mutex::scoped_lock l(mutex);
+    IndexedFile *file = findFile(name);
+    if (file == NULL)
+      return;
+    file->size = size;
+    file->mtime = mtime;
+    file->width = header_size.width;
+    file->height = header_size.height;
+    file->is_jpeg = is_jpeg;
+    file->taken = taken;
+  }
+
+  // replaces the old index with everything set since open
+  bool save() {
+    boost::mutex::scoped_lock l(mutex);
+    if (path.empty())
+      return false;
+    const std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path.c_str(), std::ios::binary | std::ios::trunc);
+    out.write("VIMAJIX2", 8);
+    size_t num_files = 0;
+    for (std::map<std::string, IndexedDir>::const_iterator it = dirs.begin();
+         it != dirs.end(); ++it) {
+      const IndexedDir &listing = it->second;
+      writeString(out, it->first);
+      writeValue(out, listing.mtime);
+      writeValue(out, (uint32_t)listing.subdirs.size());
+      for (size_t i = 0; i < listing.subdirs.size(); ++i)
+        writeString(out, listing.subdirs[i]);
+      writeValue(out, (uint32_t)listing.files.size());
+      for (size_t i = 0; i < listing.files.size(); ++i) {
+        const IndexedFile &file = listing.files[i];
+        writeString(out, file.name);
+        writeValue(out, file.size);
+        writeValue(out, file.mtime);
+        writeValue(out, file.width);
+        writeValue(out, file.height);
+        writeValue(out, file.is_jpeg);
+        writeValue(out, file.taken);
+      }
+      num_files += listing.files.size();
+    }
+    out.close();
+    if (!out.good() || (rename(tmp_path.c_str(), path.c_str()) != 0)) {
+      LOG(WARNING) << "couldn't write file index " << path;
+      unlink(tmp_path.c_str());
+      return false;
+    }
+    VLOG(1) << "wrote " << dirs.size() << " directories and " << num_files
+            << " files to " << path;
+    return true;
+  }
+};
+
+#endif // VIMAJ_FILE_INDEX_H
@@ -0,0 +1,108 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIMAJ_FRAME_STORE_H
+#define VIMAJ_FRAME_STORE_H
+
+#include <stddef.h>
+
+#include <boost/atomic.hpp>
+
+/* Append-only storage in fixed size segments that never move once
+ * allocated, so readers can index anything below size() without a lock
+ * while any number of writers append. A slot is reserved with an atomic
+ * increment and size() only advances over slots that have been completely
+ * written, so readers never see a half written value. Values must not be
+ * changed after append.
+ */
+template <typename T, int SEGMENT_BITS = 10, int MAX_SEGMENTS = 1 << 14>
+class SegmentedStore {
+  struct Slot {
+    T value;
+    boost::atomic<bool> ready;
+    Slot() : ready(false) {}
+  };
+  static const size_t SEGMENT_SIZE = (size_t)1 << SEGMENT_BITS;
+
+  boost::atomic<Slot *> segments[MAX_SEGMENTS];
+  // slots handed out to writers
+  boost::atomic<size_t> reserved;
+  // every slot below this has been written
+  boost::atomic<size_t> published;
+
+  Slot &slot(const size_t i) {
+    boost::atomic<Slot *> &segment = segments[i >> SEGMENT_BITS];
+    Slot *seg = segment.load(boost::memory_order_acquire);
+    if (seg == NULL) {
+      // whoever gets there first allocates, the others use theirs
+      Slot *fresh = new Slot[SEGMENT_SIZE];
+      if (segment.compare_exchange_strong(seg, fresh,
+                                          boost::memory_order_acq_rel)) {
+        seg = fresh;
+      } else {
+        delete[] fresh;
+      }
+    }
+    return seg[i & (SEGMENT_SIZE - 1)];
+  }
+
+public:
+  SegmentedStore() : reserved(0), published(0) {
+    for (int i = 0; i < MAX_SEGMENTS; ++i)
+      segments[i] = NULL;
+  }
+
+  ~SegmentedStore() {
+    for (int i = 0; i < MAX_SEGMENTS; ++i)
+      delete[] segments[i].load();
+  }
+
+  static size_t capacity() { return SEGMENT_SIZE * MAX_SEGMENTS; }
+
+  // the index of the new value, or capacity() if full
+  size_t append(const T &value) {
+    const size_t i = reserved.fetch_add(1);
+    if (i >= capacity())
+      return capacity();
+    Slot &s = slot(i);
+    s.value = value;
+    s.ready.store(true);
+
+    // advance published over every contiguous ready slot, whichever writer
+    // finishes the oldest outstanding slot carries it past the later ones
+    size_t p = published.load();
+    while ((p < reserved.load()) && (p < capacity()) && slot(p).ready.load()) {
+      if (published.compare_exchange_weak(p, p + 1))
+        p++;
+    }
+    return i;
+  }
+
+  size_t size() const { return published.load(boost::memory_order_acquire); }
+
+  // i must be below size(), or returned by an append that happened before
+  // this, e.g. handed over under a lock
+  const T &operator[](const size_t i) const {
+    return segments[i >> SEGMENT_BITS].load(
+        boost::memory_order_acquire)[i & (SEGMENT_SIZE - 1)].value;
+  }
+};
+
+#endif // VIMAJ_FRAME_STORE_H
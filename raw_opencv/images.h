@@ -0,0 +1,3377 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIMAJ_IMAGES_H
+#define VIMAJ_IMAGES_H
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <iostream>
+#include <limits>
+#include <poll.h>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/timer.hpp>
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <list>
+#include <map>
+#include <set>
+
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <glog/logging.h>
+
+#include "blit.h"
+#include "exif.h"
+#include "export_queue.h"
+#include "file_index.h"
+#include "frame_store.h"
+#include "mapped_file.h"
+#include "stats.h"
+#include "thumb_atlas.h"
+#include "tile_pyramid.h"
+#include "video_frames.h"
+
+// bash color codes
+#define CLNRM "\e[0m"
+#define CLWRN "\e[0;43m"
+#define CLERR "\e[1;41m"
+#define CLVAL "\e[1;36m"
+#define CLTXT "\e[1;35m"
+// BOLD black text with blue background
+#define CLTX2 "\e[1;44m"
+
+inline bool isImageName(const std::string &name) {
+  const std::string ext = boost::algorithm::to_lower_copy(
+      boost::filesystem::path(name).extension().string());
+  return (ext == ".jpg") || (ext == ".jpeg") || (ext == ".png");
+}
+
+/* Natural sort order, runs of digits compare by value so img_9 comes before
+ * img_10, and letters compare case insensitively.
+ */
+inline bool naturalLess(const std::string &a, const std::string &b) {
+  size_t i = 0;
+  size_t j = 0;
+  while ((i < a.size()) && (j < b.size())) {
+    if (isdigit((unsigned char)a[i]) && isdigit((unsigned char)b[j])) {
+      // skip leading zeros, then the longer number is larger
+      while ((i < a.size()) && (a[i] == '0'))
+        i++;
+      while ((j < b.size()) && (b[j] == '0'))
+        j++;
+      size_t i_end = i;
+      while ((i_end < a.size()) && isdigit((unsigned char)a[i_end]))
+        i_end++;
+      size_t j_end = j;
+      while ((j_end < b.size()) && isdigit((unsigned char)b[j_end]))
+        j_end++;
+      if (i_end - i != j_end - j)
+        return (i_end - i) < (j_end - j);
+      const int cmp = a.compare(i, i_end - i, b, j, j_end - j);
+      if (cmp != 0)
+        return cmp < 0;
+      i = i_end;
+      j = j_end;
+    } else {
+      const int ca = tolower((unsigned char)a[i]);
+      const int cb = tolower((unsigned char)b[j]);
+      if (ca != cb)
+        return ca < cb;
+      i++;
+      j++;
+    }
+  }
+  if (a.size() - i != b.size() - j)
+    return (a.size() - i) < (b.size() - j);
+  // only equal if identical
+  return a < b;
+}
+
+/* Read the pixel dimensions from a jpeg or png header without decoding,
+ * is_jpeg is set when the file can be decoded at reduced resolution. The
+ * exif block of a jpeg is parsed into exif unless it is NULL.
+ */
+inline bool readImageSize(const std::string &name, cv::Size &size,
+                          bool &is_jpeg, ExifInfo *exif = NULL) {
+  is_jpeg = false;
+  std::ifstream file(name.c_str(), std::ios::binary);
+  unsigned char b[24];
+  if (!file.read((char *)b, 2))
+    return false;
+
+  if ((b[0] == 0x89) && (b[1] == 'P')) {
+    // png signature is 8 bytes, then the IHDR chunk length and type
+    if (!file.read((char *)b + 2, 22))
+      return false;
+    if ((b[12] != 'I') || (b[13] != 'H') || (b[14] != 'D') || (b[15] != 'R'))
+      return false;
+    size.width = (b[16] << 24) | (b[17] << 16) | (b[18] << 8) | b[19];
+    size.height = (b[20] << 24) | (b[21] << 16) | (b[22] << 8) | b[23];
+    return true;
+  }
+
+  if ((b[0] != 0xff) || (b[1] != 0xd8))
+    return false;
+  // walk the marker segments until the start of frame
+  while (file.read((char *)b, 1)) {
+    if (b[0] != 0xff)
+      continue;
+    // markers may be padded with any number of 0xff
+    do {
+      if (!file.read((char *)b, 1))
+        return false;
+    } while (b[0] == 0xff);
+    const unsigned char marker = b[0];
+    // standalone markers without a length
+    if ((marker == 0x01) || ((marker >= 0xd0) && (marker <= 0xd7)))
+      continue;
+    // end of image or start of scan before any frame header
+    if ((marker == 0xd9) || (marker == 0xda))
+      return false;
+    if (!file.read((char *)b, 2))
+      return false;
+    const int length = (b[0] << 8) | b[1];
+    if (length < 2)
+      return false;
+    if ((marker >= 0xc0) && (marker <= 0xcf) && (marker != 0xc4) &&
+        (marker != 0xc8) && (marker != 0xcc)) {
+      // precision, height, width
+      if (!file.read((char *)b, 5))
+        return false;
+      size.height = (b[1] << 8) | b[2];
+      size.width = (b[3] << 8) | b[4];
+      is_jpeg = true;
+      return true;
+    }
+    if ((exif != NULL) && (marker == 0xe1) && (length > 8)) {
+      std::vector<unsigned char> app1(length - 2);
+      if (!file.read((char *)&app1[0], app1.size()))
+        return false;
+      if (memcmp(&app1[0], "Exif\0\0", 6) == 0)
+        parseExif(&app1[6], app1.size() - 6, *exif);
+      continue;
+    }
+    file.seekg(length - 2, std::ios::cur);
+  }
+  return false;
+}
+
+/* Scaled frames persisted across runs, one file per image directory and
+ * scaling parameters. The file is an append-only sequence of records that
+ * is memory mapped on open so cached frames are used in place, a record
+ * is stale once a later one for the same image supersedes it or the image
+ * mtime or size no longer match.
+ */
+class ThumbCache {
+  struct FileHeader {
+    char magic[8];
+    int32_t width;
+    int32_t height;
+    float max_scale;
+    int32_t pad;
+  };
+  struct RecordHeader {
+    char magic[4];
+    uint32_t name_len;
+    int64_t mtime;
+    uint64_t file_size;
+    int32_t full_width;
+    int32_t full_height;
+    int32_t rows;
+    int32_t cols;
+    int32_t type;
+    int32_t pad;
+    uint64_t data_bytes;
+  };
+  struct Record {
+    int64_t mtime;
+    uint64_t file_size;
+    cv::Size full_size;
+    cv::Mat scaled;
+    // seen during this run, unused records are dropped on compaction
+    bool used;
+  };
+  std::map<std::string, Record> records;
+  std::string path;
+  FileHeader file_header;
+  void *map_ptr;
+  size_t map_size;
+  std::ofstream out;
+  // out is open, kept apart since out is written without mutex
+  bool writable;
+  // records added since the last flush, written out together
+  std::string pending;
+  static const size_t FLUSH_BYTES = 16 << 20;
+  // bytes on disk of records that are current, and of all records, the
+  // pending ones included
+  size_t live_bytes;
+  size_t file_bytes;
+  boost::mutex mutex;
+  // held while out is written or reopened, taken before mutex
+  boost::mutex out_mutex;
+
+  static size_t align(const size_t offset) { return (offset + 15) & ~15; }
+
+  static size_t recordBytes(const std::string &name, const cv::Mat &scaled) {
+    return align(align(sizeof(RecordHeader) + name.size()) +
+                 scaled.total() * scaled.elemSize());
+  }
+
+  // appended to buf
+  static void writeRecord(std::string &buf, const std::string &name,
+                          const Record &record) {
+    RecordHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "VMJT", 4);
+    header.name_len = name.size();
+    header.mtime = record.mtime;
+    header.file_size = record.file_size;
+    header.full_width = record.full_size.width;
+    header.full_height = record.full_size.height;
+    header.rows = record.scaled.rows;
+    header.cols = record.scaled.cols;
+    header.type = record.scaled.type();
+    header.data_bytes = record.scaled.total() * record.scaled.elemSize();
+
+    static const char zeros[16] = {0};
+    const size_t name_end = sizeof(header) + name.size();
+    buf.append((const char *)&header, sizeof(header));
+    buf.append(name);
+    buf.append(zeros, align(name_end) - name_end);
+    for (int y = 0; y < record.scaled.rows; ++y)
+      buf.append((const char *)record.scaled.ptr(y),
+                 record.scaled.cols * record.scaled.elemSize());
+    buf.append(zeros, align(header.data_bytes) - header.data_bytes);
+  }
+
+  // returns the offset after the last complete record
+  size_t scan() {
+    const unsigned char *base = (const unsigned char *)map_ptr;
+    size_t offset = sizeof(FileHeader);
+    while (offset + sizeof(RecordHeader) <= map_size) {
+      const RecordHeader *header = (const RecordHeader *)(base + offset);
+      if (memcmp(header->magic, "VMJT", 4) != 0)
+        break;
+      const size_t data_offset =
+          align(offset + sizeof(RecordHeader) + header->name_len);
+      const size_t end = align(data_offset + header->data_bytes);
+      if ((end > map_size) || (header->rows < 0) || (header->cols < 0) ||
+          (header->data_bytes != (uint64_t)header->rows * header->cols *
+                                     CV_ELEM_SIZE(header->type)))
+        break;
+
+      const std::string name(
+          (const char *)(base + offset + sizeof(RecordHeader)),
+          header->name_len);
+      Record &record = records[name];
+      record.mtime = header->mtime;
+      record.file_size = header->file_size;
+      record.full_size = cv::Size(header->full_width, header->full_height);
+      record.scaled = cv::Mat(header->rows, header->cols, header->type,
+                              (void *)(base + data_offset));
+      record.used = false;
+      offset = end;
+    }
+    return offset;
+  }
+
+  void unmap() {
+    if (map_ptr != NULL)
+      munmap(map_ptr, map_size);
+    map_ptr = NULL;
+    map_size = 0;
+  }
+
+public:
+  ThumbCache()
+      : map_ptr(NULL), map_size(0), writable(false), live_bytes(0),
+        file_bytes(0) {}
+
+  // the records may point into the mapping, so callers need to be done with
+  // the scaled frames before this goes away
+  ~ThumbCache() {
+    flush();
+    out.close();
+    records.clear();
+    unmap();
+  }
+
+  static bool statFile(const std::string &name, int64_t &mtime,
+                       uint64_t &size) {
+    // a video frame's is the video's
+    struct stat st;
+    if (stat(VideoFrames::getPath(name).c_str(), &st) != 0)
+      return false;
+    mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    size = st.st_size;
+    return true;
+  }
+
+  // source identifies the set of images, see Images::getSourceKey
+  bool open(const std::string &cache_dir, const std::string &source,
+            const cv::Size sz, const float max_scale) {
+    try {
+      boost::filesystem::create_directories(cache_dir);
+    } catch (const boost::filesystem::filesystem_error &ex) {
+      LOG(WARNING) << "no thumbnail cache: " << ex.what();
+      return false;
+    }
+
+    // everything the scaled frames depend on besides the images
+    std::stringstream key;
+    key << source << "_" << sz.width << "x" << sz.height << "_" << max_scale;
+    std::stringstream name;
+    name << cache_dir << "/" << std::hex << fnv1a(key.str()) << ".thumbs";
+    path = name.str();
+
+    memset(&file_header, 0, sizeof(file_header));
+    memcpy(file_header.magic, "VIMAJTC1", 8);
+    file_header.width = sz.width;
+    file_header.height = sz.height;
+    file_header.max_scale = max_scale;
+
+    size_t valid_end = 0;
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      struct stat st;
+      if ((fstat(fd, &st) == 0) && (st.st_size >= (off_t)sizeof(FileHeader))) {
+        map_size = st.st_size;
+        map_ptr = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map_ptr == MAP_FAILED) {
+          map_ptr = NULL;
+          map_size = 0;
+        }
+      }
+      ::close(fd);
+    }
+    if ((map_ptr != NULL) &&
+        (memcmp(map_ptr, &file_header, sizeof(file_header)) == 0)) {
+      valid_end = scan();
+      // drop anything partially written by a previous run
+      if ((valid_end < map_size) && (truncate(path.c_str(), valid_end) != 0))
+        valid_end = 0;
+    }
+
+    if (valid_end == 0) {
+      records.clear();
+      out.open(path.c_str(), std::ios::binary | std::ios::trunc);
+      out.write((const char *)&file_header, sizeof(file_header));
+      valid_end = sizeof(file_header);
+    } else {
+      out.open(path.c_str(), std::ios::binary | std::ios::app);
+    }
+    file_bytes = valid_end;
+    writable = out.good();
+    LOG(INFO) << "thumbnail cache " << path << " has " << records.size()
+              << " frames";
+    return writable;
+  }
+
+  bool lookup(const std::string &name, const int64_t mtime,
+              const uint64_t file_size, cv::Mat &scaled,
+              cv::Size &full_size) {
+    boost::mutex::scoped_lock l(mutex);
+    std::map<std::string, Record>::iterator it = records.find(name);
+    if ((it == records.end()) || (it->second.mtime != mtime) ||
+        (it->second.file_size != file_size))
+      return false;
+    if (!it->second.used)
+      live_bytes += recordBytes(name, it->second.scaled);
+    it->second.used = true;
+    scaled = it->second.scaled;
+    full_size = it->second.full_size;
+    return true;
+  }
+
+  void add(const std::string &name, const int64_t mtime,
+           const uint64_t file_size, const cv::Size full_size,
+           const cv::Mat &scaled) {
+    bool full;
+    {
+      boost::mutex::scoped_lock l(mutex);
+      if (!writable || !scaled.isContinuous())
+        return;
+      Record &record = records[name];
+      if (record.used)
+        live_bytes -= recordBytes(name, record.scaled);
+      record.mtime = mtime;
+      record.file_size = file_size;
+      record.full_size = full_size;
+      record.scaled = scaled;
+      record.used = true;
+      writeRecord(pending, name, record);
+      const size_t bytes = recordBytes(name, scaled);
+      live_bytes += bytes;
+      file_bytes += bytes;
+      full = pending.size() >= FLUSH_BYTES;
+    }
+    if (full)
+      flush();
+  }
+
+  // write out the records added since the last flush, lookups and adds
+  // carry on meanwhile
+  void flush() {
+    boost::mutex::scoped_lock w(out_mutex);
+    std::string batch;
+    {
+      boost::mutex::scoped_lock l(mutex);
+      batch.swap(pending);
+      if (!writable)
+        return;
+    }
+    if (batch.empty())
+      return;
+    STAGE_TIMER("thumb_write");
+    out.write(batch.data(), batch.size());
+    out.flush();
+  }
+
+  /* rewrite the file without stale records once they are the majority
+   */
+  void compact() {
+    boost::mutex::scoped_lock w(out_mutex);
+    boost::mutex::scoped_lock l(mutex);
+    if (!writable || (file_bytes < 2 * live_bytes + sizeof(FileHeader)))
+      return;
+    LOG(INFO) << "compacting thumbnail cache from " << file_bytes << " to "
+              << live_bytes << " bytes";
+    out.close();
+    // the old file stays mapped for the frames already handed out
+    const std::string tmp_path = path + ".tmp";
+    out.open(tmp_path.c_str(), std::ios::binary | std::ios::trunc);
+    out.write((const char *)&file_header, sizeof(file_header));
+    // the pending records are among the used ones
+    pending.clear();
+    std::string buf;
+    for (std::map<std::string, Record>::iterator it = records.begin();
+         it != records.end();) {
+      if (it->second.used) {
+        buf.clear();
+        writeRecord(buf, it->first, it->second);
+        out.write(buf.data(), buf.size());
+        ++it;
+      } else {
+        records.erase(it++);
+      }
+    }
+    out.close();
+    if (rename(tmp_path.c_str(), path.c_str()) != 0)
+      LOG(WARNING) << "couldn't replace " << path;
+    out.open(path.c_str(), std::ios::binary | std::ios::app);
+    writable = out.good();
+    file_bytes = live_bytes + sizeof(FileHeader);
+  }
+};
+
+/* Full resolution frames keyed by file name, evicting the least recently
+ * used entries once the memory budget is exceeded.
+ */
+class FrameCache {
+  struct Entry {
+    // the full frame followed by successive halvings, built on demand
+    std::vector<cv::Mat> levels;
+    size_t bytes;
+    std::list<std::string>::iterator lru_it;
+  };
+  std::map<std::string, Entry> entries;
+  // most recently used at the front
+  std::list<std::string> lru;
+  size_t budget;
+  size_t used;
+  // running total of every frame put, to estimate how many will fit
+  size_t put_bytes;
+  size_t put_count;
+  boost::mutex mutex;
+  boost::condition_variable cond;
+
+  static size_t bytes(const cv::Mat &im) { return im.total() * im.elemSize(); }
+
+  void evict() {
+    // always keep the most recent entry even if it alone is over budget
+    while ((used > budget) && (lru.size() > 1)) {
+      std::map<std::string, Entry>::iterator it = entries.find(lru.back());
+      used -= it->second.bytes;
+      VLOG(2) << "evicting " << it->first;
+      entries.erase(it);
+      lru.pop_back();
+    }
+  }
+
+public:
+  FrameCache(size_t budget)
+      : budget(budget), used(0), put_bytes(0), put_count(0) {}
+
+  // an empty Mat if not resident
+  cv::Mat get(const std::string &name) {
+    boost::mutex::scoped_lock l(mutex);
+    std::map<std::string, Entry>::iterator it = entries.find(name);
+    if (it == entries.end())
+      return cv::Mat();
+    lru.splice(lru.begin(), lru, it->second.lru_it);
+    return it->second.levels[0];
+  }
+
+  /* Pyramid level 0 is the full frame and each level after is half the size
+   * of the one before. Missing levels are built from the smallest existing
+   * one, an empty Mat if the frame isn't resident.
+   */
+  cv::Mat getLevel(const std::string &name, const int level) {
+    cv::Mat src;
+    size_t have;
+    {
+      boost::mutex::scoped_lock l(mutex);
+      std::map<std::string, Entry>::iterator it = entries.find(name);
+      if (it == entries.end())
+        return cv::Mat();
+      lru.splice(lru.begin(), lru, it->second.lru_it);
+      if ((size_t)level < it->second.levels.size())
+        return it->second.levels[level];
+      src = it->second.levels.back();
+      have = it->second.levels.size();
+    }
+
+    // build outside the lock, only the first level needs the large source
+    std::vector<cv::Mat> built;
+    for (size_t i = have; i <= (size_t)level; ++i) {
+      if ((src.cols < 2) || (src.rows < 2))
+        break;
+      STAGE_TIMER("pyramid");
+      cv::Mat half;
+      cv::resize(src, half, cv::Size((src.cols + 1) / 2, (src.rows + 1) / 2),
+                 0, 0, cv::INTER_AREA);
+      built.push_back(half);
+      src = half;
+    }
+
+    boost::mutex::scoped_lock l(mutex);
+    std::map<std::string, Entry>::iterator it = entries.find(name);
+    // unless evicted or another thread got there first
+    if ((it != entries.end()) && (it->second.levels.size() == have)) {
+      for (size_t i = 0; i < built.size(); ++i) {
+        it->second.levels.push_back(built[i]);
+        it->second.bytes += bytes(built[i]);
+        used += bytes(built[i]);
+      }
+      evict();
+    }
+    return src;
+  }
+
+  void erase(const std::string &name) {
+    boost::mutex::scoped_lock l(mutex);
+    std::map<std::string, Entry>::iterator it = entries.find(name);
+    if (it == entries.end())
+      return;
+    used -= it->second.bytes;
+    lru.erase(it->second.lru_it);
+    entries.erase(it);
+  }
+
+  // mark as recently used, returns false if not resident
+  bool touch(const std::string &name) {
+    boost::mutex::scoped_lock l(mutex);
+    std::map<std::string, Entry>::iterator it = entries.find(name);
+    if (it == entries.end())
+      return false;
+    lru.splice(lru.begin(), lru, it->second.lru_it);
+    return true;
+  }
+
+  // if only_if_room is set nothing is evicted to make space
+  bool put(const std::string &name, const cv::Mat &frame,
+           const bool only_if_room = false) {
+    if (frame.empty())
+      return false;
+    {
+      boost::mutex::scoped_lock l(mutex);
+      put_bytes += bytes(frame);
+      put_count++;
+      if (only_if_room && (used + bytes(frame) > budget))
+        return false;
+      std::map<std::string, Entry>::iterator it = entries.find(name);
+      if (it != entries.end()) {
+        used -= it->second.bytes;
+        lru.erase(it->second.lru_it);
+        entries.erase(it);
+      }
+      lru.push_front(name);
+      Entry &entry = entries[name];
+      entry.levels.push_back(frame);
+      entry.bytes = bytes(frame);
+      entry.lru_it = lru.begin();
+      used += entry.bytes;
+      evict();
+    }
+    cond.notify_all();
+    return true;
+  }
+
+  // wait up to timeout_ms for the frame to be put
+  cv::Mat waitFor(const std::string &name, const int timeout_ms) {
+    const boost::system_time timeout =
+        boost::get_system_time() + boost::posix_time::milliseconds(timeout_ms);
+    boost::mutex::scoped_lock l(mutex);
+    while (true) {
+      std::map<std::string, Entry>::iterator it = entries.find(name);
+      if (it != entries.end()) {
+        lru.splice(lru.begin(), lru, it->second.lru_it);
+        return it->second.levels[0];
+      }
+      if (!cond.timed_wait(l, timeout))
+        return cv::Mat();
+    }
+  }
+
+  size_t getBudget() const { return budget; }
+
+  // average size of the frames seen so far, or default_bytes if none
+  size_t averageBytes(const size_t default_bytes) {
+    boost::mutex::scoped_lock l(mutex);
+    if (put_count == 0)
+      return default_bytes;
+    return put_bytes / put_count;
+  }
+};
+
+// the order images are shown in, each falling back to the name for ties
+enum SortMode { SORT_NAME, SORT_DATE, SORT_SIZE, SORT_PIXELS, NUM_SORT_MODES };
+
+inline const char *getSortModeName(const int mode) {
+  static const char *names[NUM_SORT_MODES] = {"name", "date", "size",
+                                              "pixels"};
+  return names[mode];
+}
+
+inline bool parseSortMode(const std::string &name, SortMode &mode) {
+  for (int i = 0; i < NUM_SORT_MODES; ++i) {
+    if (name == getSortModeName(i)) {
+      mode = (SortMode)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// settings for Images, vimaj fills these in from the command line flags
+struct ImagesConfig {
+  // the size of the rendered image
+  cv::Size sz;
+  // maximum amount to scale the image
+  float max_scale;
+  // 0 for one per core
+  int decode_threads;
+  // memory budget for full resolution frames
+  int cache_mb;
+  // empty to not use the on disk cache
+  std::string thumb_cache_dir;
+  // keep loading images as they appear in the scanned directories
+  bool watch;
+  // directories or image files, the current directory if none and no list
+  std::vector<std::string> roots;
+  // descend into the subdirectories of roots
+  bool recursive;
+  // a file with one image path per line, - for stdin
+  std::string list_file;
+  // where to keep the file index, empty for none
+  std::string index_dir;
+  // where to keep tile pyramids, empty to always decode whole images
+  std::string tile_dir;
+  // images of at least this many megapixels are viewed through tiles
+  int tile_min_mpix;
+  // memory budget for decoded tiles
+  int tile_mb;
+  // how saved rois are written
+  ExportConfig exports;
+  // views rendered ahead on each side of the current one
+  int render_ahead;
+  // memory budget for views rendered ahead
+  int render_mb;
+  // bilinear instead of nearest neighbor resampling
+  bool smooth;
+  // once the view has been still this long it is rendered again with area
+  // or cubic interpolation, 0 to not, needs render_ahead
+  int refine_ms;
+  // keep every file mapped and decode full resolution frames from that
+  bool mmap_originals;
+  // show the previews embedded in jpegs until they are decoded
+  bool exif_previews;
+  // the initial order, 'o' cycles through the others
+  SortMode sort_mode;
+  // columns of the overview grid
+  int grid_cols;
+
+  ImagesConfig()
+      : sz(800, 600), max_scale(1.5), decode_threads(0), cache_mb(1024),
+        watch(false), recursive(false), tile_min_mpix(64), tile_mb(256),
+        render_ahead(4), render_mb(256), smooth(false), refine_ms(150),
+        mmap_originals(false), exif_previews(true), sort_mode(SORT_NAME),
+        grid_cols(6) {}
+};
+
+class Images {
+
+  float progress;
+
+  // the size of the rendered image
+  cv::Size sz;
+  // an roi in units of the rendered image
+  // cv::Rect roi;
+
+  float max_scale;
+  int decode_threads;
+  // empty to not use the on disk cache
+  std::string thumb_cache_dir;
+  // needs to outlive entries, whose scaled frames may point into its mapped
+  // file
+  ThumbCache thumbs;
+  // full resolution frames near the current index
+  FrameCache frames_orig;
+  // images this big are tiled instead of going in frames_orig
+  std::string tile_dir;
+  int64_t tile_min_pixels;
+  TileCache tile_cache;
+  // how long rendering ahead waits for a full resolution frame before
+  // falling back to the scaled one, getFrame doesn't wait, TBD flag?
+  int orig_wait_ms;
+  // saved rois, may be loading from frames_orig
+  ExportQueue exports;
+
+  // one per decoded image, never changed once appended
+  struct FrameEntry {
+    std::string name;
+    // empty for a video frame, which is only read at full resolution into
+    // frames_orig while it is near the current one
+    cv::Mat scaled;
+    // size of the full resolution image, which frames_orig may not have yet
+    cv::Size full_size;
+    // the encoded file if mmap_originals, to decode full frames from
+    boost::shared_ptr<const MappedFile> mapped;
+    // index into files, for centering decoding on it
+    uint32_t file_ind;
+    // set for images too big for frames_orig
+    boost::shared_ptr<TilePyramid> tiles;
+    // an exif preview standing in for the scaled frame until the decoded
+    // one replaces it, scaled is left empty here and is in previews
+    bool preview;
+  };
+  SegmentedStore<FrameEntry> entries;
+  // the pixels of the previews not replaced yet by name, kept out of entries
+  // so they can be released when flushOrder drops their slots
+  boost::mutex preview_mutex;
+  std::map<std::string, cv::Mat> previews;
+
+  static const uint32_t NO_RANK = 0xffffffff;
+  /* The display order as indices into entries. A new one replaces the old
+   * as a whole so the ui can use whichever one it loaded without locking,
+   * and is freed when the last thread holding it lets go.
+   */
+  struct FrameOrder {
+    uint64_t version;
+    std::vector<uint32_t> slots;
+    // position in slots of each entry, NO_RANK if replaced or not yet in it
+    std::vector<uint32_t> rank;
+  };
+  // only through boost::atomic_load and atomic_store, see getOrder
+  boost::shared_ptr<const FrameOrder> order;
+  // only the writers take this, to merge new entries into the next order
+  boost::mutex order_mutex;
+  std::vector<uint32_t> pending_slots;
+  // the newest entry for each file, for files rewritten while watching
+  std::map<std::string, uint32_t> slot_by_name;
+  // what the header pass found out about each file, by index into files
+  struct FileMeta {
+    // exif capture time or else mtime, in nanoseconds
+    int64_t date;
+    uint64_t size;
+    int64_t pixels;
+    bool known;
+
+    FileMeta() : date(0), size(0), pixels(0), known(false) {}
+  };
+  std::vector<FileMeta> file_meta;
+  SortMode sort_mode;
+  // the sort keys of entries already in order changed
+  bool resort;
+  boost::posix_time::ptime last_order_flush;
+
+  boost::thread im_thread;
+  std::vector<std::string> roots;
+  bool recursive;
+  std::string list_file;
+  std::string index_dir;
+  FileIndex index;
+  // each directory is watched just before it is listed, events the
+  // listing may already have covered are held in watch_early until the
+  // initial scan is done and then only the files it didn't find are added
+  boost::mutex watch_mutex;
+  int watch_fd;
+  std::map<int, std::string> watched;
+  bool watch_scanning;
+  std::set<std::string> watch_early;
+  // every image file found so far, in the order found
+  std::vector<std::string> files;
+
+  // the scan appends to files and the decode workers take the nearest to
+  // decode_center first, publishing each into entries as soon as it is done
+  boost::thread_group decode_workers;
+  boost::mutex decode_mutex;
+  boost::condition_variable decode_cond;
+  // indices into files no worker has taken yet
+  std::set<size_t> undecoded;
+  // the next file for the header pass, which goes through them in order
+  size_t next_meta;
+  size_t num_meta;
+  // the file the user is on or jumping to
+  size_t decode_center;
+  size_t num_decoded;
+  // no more files will be added
+  bool scan_done;
+  // the initial scan finished uninterrupted, so the index has every
+  // directory and can be saved
+  bool listed;
+  bool watch;
+  // everything found by the initial scan has been decoded
+  boost::atomic<bool> loaded;
+  bool exif_previews;
+
+  // the prefetcher loads full resolution frames around prefetch_ind,
+  // reaching further in the direction of travel
+  boost::thread prefetch_thread;
+  boost::mutex prefetch_mutex;
+  boost::condition_variable prefetch_cond;
+  int prefetch_ind;
+  int prefetch_dir;
+  // incremented whenever there is something new to prefetch
+  int prefetch_gen;
+
+  // what a thread needs to render without allocating each time, the ui
+  // and render ahead threads each have one
+  struct RenderScratch {
+    Resampler resampler;
+  };
+  RenderScratch ui_scratch;
+  // halvings of the scaled frames for zooming out, level 0 is the scaled
+  // frame itself, within the render_mb budget
+  FrameCache scaled_levels;
+  bool mmap_originals;
+  // output frames, the ones rendered ahead included
+  FramePool frame_pool;
+  bool smooth;
+  int refine_ms;
+
+  // what a view depends on besides the image
+  struct ViewParams {
+    double zoom;
+    cv::Point2f pos;
+    float roi_aspect;
+    bool operator==(const ViewParams &other) const {
+      return (zoom == other.zoom) && (pos == other.pos) &&
+             (roi_aspect == other.roi_aspect);
+    }
+  };
+  // a composited view without the hud, which changes every frame
+  struct RenderedView {
+    cv::Mat dst;
+    // what dst was rendered from, for saving the roi
+    cv::Mat src;
+    cv::Rect roi;
+    // where roi ended up in dst
+    cv::Rect dst_rect;
+    // rendered with the slow filters
+    bool hq;
+    // the tile pyramid level src is part of and where, -1 if not tiled
+    int tile_level;
+    cv::Point tile_origin;
+
+    RenderedView() : hq(false), tile_level(-1) {}
+  };
+  // renders the views around render_ind at the current view params so
+  // stepping through them only needs an imshow
+  boost::thread render_thread;
+  boost::mutex render_mutex;
+  boost::condition_variable render_cond;
+  int render_ahead;
+  size_t render_max_bytes;
+  ViewParams render_params;
+  int render_ind;
+  int render_dir;
+  // incremented whenever render_ind or render_params change
+  int render_gen;
+  // when render_gen last changed, for refining once the view is still
+  boost::system_time render_changed;
+  // keyed by entry slot, all rendered with render_params
+  std::map<uint32_t, RenderedView> rendered;
+
+  // what getFrame last showed, so ind can follow that image when frames are
+  // inserted before it
+  int cur_ind;
+  uint32_t cur_slot;
+  uint64_t cur_order_version;
+  // what it was rendered from, the part of that shown and where
+  cv::Mat cur_im;
+  cv::Rect cur_roi;
+  cv::Rect cur_dst_rect;
+  // the tile pyramid level cur_im is part of and where, -1 if not tiled
+  int cur_tile_level;
+  cv::Point cur_tile_origin;
+  // the full resolution frame the view getFrame returned last was waiting
+  // for, empty if it wasn't a placeholder, or the tiles being built for it
+  std::string refine_name;
+  boost::shared_ptr<TilePyramid> refine_tiles;
+  // it was rendered with the fast filter
+  bool refine_hq;
+  // it was of an exif preview
+  bool refine_preview;
+  // a file jumped to that getFrame goes to once it is decoded
+  std::string jump_name;
+
+  // the overview, getFrame draws a grid of thumbnails instead of the view
+  bool grid;
+  int grid_cols;
+  // the first row shown
+  int grid_top;
+  // thumbnails of the rows shown and a screen either side, made from the
+  // scaled frames by grid_thread as they are wanted
+  ThumbAtlas grid_atlas;
+  boost::thread grid_thread;
+  boost::mutex grid_mutex;
+  boost::condition_variable grid_cond;
+  // slots to make thumbnails of, the ones shown first, for the cells of
+  // atlas generation grid_wanted_gen
+  std::deque<uint32_t> grid_wanted;
+  int grid_wanted_gen;
+  // incremented for each thumbnail made
+  boost::atomic<int> grid_made;
+  // grid_made when the grid was drawn last, and if cells were left empty
+  int grid_drawn;
+  bool grid_missing;
+
+  // pyramids are built by tile_thread one at a time, since each needs the
+  // whole image decoded, while the decode workers go on with the rest
+  boost::thread tile_thread;
+  boost::mutex tile_mutex;
+  boost::condition_variable tile_cond;
+  std::deque<FrameEntry> tile_jobs;
+  // OpenCV's default OPENCV_IO_MAX_IMAGE_PIXELS, read once as the library
+  // loads, larger images are only ever read through their tiles
+  static const int64_t max_decode_pixels = (int64_t)1 << 30;
+
+public:
+  float roi_aspect;
+
+  // overlay the stage timings
+  bool show_hud;
+
+  boost::atomic<bool> continue_loading;
+
+  int ind;
+
+  Images(const ImagesConfig &config)
+      : progress(0.0), sz(config.sz), max_scale(config.max_scale),
+        decode_threads(config.decode_threads),
+        thumb_cache_dir(config.thumb_cache_dir),
+        frames_orig((size_t)config.cache_mb * 1024 * 1024),
+        tile_dir(config.tile_dir),
+        tile_min_pixels((int64_t)config.tile_min_mpix * 1000000),
+        tile_cache((size_t)config.tile_mb * 1024 * 1024), orig_wait_ms(300),
+        exports(config.exports), sort_mode(config.sort_mode), resort(false),
+        roots(config.roots), recursive(config.recursive),
+        list_file(config.list_file), index_dir(config.index_dir),
+        watch_fd(-1), watch_scanning(true), next_meta(0), num_meta(0),
+        decode_center(0), num_decoded(0), scan_done(false), listed(false),
+        watch(config.watch), loaded(false),
+        exif_previews(config.exif_previews),
+        prefetch_ind(0), prefetch_dir(1), prefetch_gen(0),
+        scaled_levels((size_t)config.render_mb * 1024 * 1024),
+        mmap_originals(config.mmap_originals),
+        frame_pool(2 * config.render_ahead + 8), smooth(config.smooth),
+        refine_ms((config.render_ahead > 0) ? config.refine_ms : 0),
+        render_ahead(config.render_ahead),
+        render_max_bytes((size_t)config.render_mb * 1024 * 1024),
+        render_ind(0), render_dir(1), render_gen(0),
+        render_changed(boost::get_system_time()),
+        cur_ind(0),
+        cur_slot(NO_RANK),
+        cur_order_version(0), cur_tile_level(-1), refine_hq(false),
+        refine_preview(false), grid(false),
+        grid_cols(std::min(std::max(config.grid_cols, 1), 32)), grid_top(0),
+        grid_wanted_gen(0), grid_made(0), grid_drawn(0), grid_missing(false),
+        roi_aspect(1.0),
+        show_hud(false), continue_loading(true), ind(0) {
+    if (this->decode_threads < 1)
+      this->decode_threads = boost::thread::hardware_concurrency();
+    if (this->decode_threads < 1)
+      this->decode_threads = 1;
+    if (this->roots.empty() && list_file.empty())
+      this->roots.push_back(".");
+    // trailing slashes would make different names for the same files
+    for (size_t i = 0; i < this->roots.size(); ++i) {
+      std::string &root = this->roots[i];
+      while ((root.size() > 1) && (root[root.size() - 1] == '/'))
+        root.erase(root.size() - 1);
+    }
+    boost::shared_ptr<FrameOrder> empty(new FrameOrder);
+    empty->version = 0;
+    order = empty;
+    render_params.zoom = 1.0;
+    render_params.pos = cv::Point2f(0.5, 0.5);
+    render_params.roi_aspect = roi_aspect;
+    im_thread = boost::thread(&Images::runThread, this);
+    prefetch_thread = boost::thread(&Images::prefetchThread, this);
+    grid_thread = boost::thread(&Images::gridThread, this);
+    tile_thread = boost::thread(&Images::tileThread, this);
+    if (render_ahead > 0)
+      render_thread = boost::thread(&Images::renderThread, this);
+
+  } // Images
+
+  ~Images() {
+    // pending saves still need frames_orig and the mapped files
+    exports.finish();
+    continue_loading = false;
+    decode_cond.notify_all();
+    prefetch_cond.notify_all();
+    render_cond.notify_all();
+    grid_cond.notify_all();
+    tile_cond.notify_all();
+    im_thread.join();
+    prefetch_thread.join();
+    render_thread.join();
+    grid_thread.join();
+    tile_thread.join();
+  }
+
+  void runThread() {
+    // boost::timer measures cpu time which adds up across the decode threads
+    const boost::posix_time::ptime t0 =
+        boost::posix_time::microsec_clock::universal_time();
+    const std::string source = getSourceKey();
+    if (!thumb_cache_dir.empty())
+      thumbs.open(thumb_cache_dir, source, sz, max_scale);
+    if (!index_dir.empty()) {
+      index.open(index_dir, source);
+      VideoFrames::get().setCacheDir(index_dir);
+    }
+
+    boost::thread watch_thread;
+    if (watch) {
+      watch_fd = inotify_init1(IN_CLOEXEC);
+      if (watch_fd < 0)
+        LOG(ERROR) << CLERR << "can't watch directories" << CLNRM;
+      else
+        watch_thread = boost::thread(&Images::watchThread, this);
+    }
+
+    loadAndResizeImages();
+    loaded = true;
+
+    thumbs.flush();
+    // an interrupted load hasn't checked which cached frames are still used
+    if (continue_loading)
+      thumbs.compact();
+    // with whatever header fields were read, even if interrupted
+    if (listed)
+      index.save();
+
+    float t1_elapsed =
+        (boost::posix_time::microsec_clock::universal_time() - t0)
+            .total_microseconds() /
+        1e6;
+
+    const int num = getNum();
+    LOG(INFO) << "loaded " << num << " in time " << t1_elapsed << " "
+              << (float)t1_elapsed / (float)num << ", "
+              << ((t1_elapsed > 0) ? num / t1_elapsed : 0.0)
+              << " images/s with " << decode_threads << " decode threads";
+
+    // until loading is stopped
+    if (watch_thread.joinable())
+      watch_thread.join();
+    if (watch_fd >= 0)
+      ::close(watch_fd);
+
+    {
+      boost::mutex::scoped_lock l(decode_mutex);
+      scan_done = true;
+    }
+    decode_cond.notify_all();
+    decode_workers.join_all();
+  }
+
+  // TBD is this any faster than warpImage?
+  // dst needs to exist before rendering
+  bool renderImage(cv::Mat &src, cv::Mat &dst, cv::Rect &roi, int offx = 0,
+                   int offy = 0) {
+    if (offx > dst.cols)
+      return false;
+    if (offy > dst.rows)
+      return false;
+    if (-offx >= src.cols)
+      return false;
+    if (-offy >= src.rows)
+      return false;
+
+    int src_x = 0;
+    int src_y = 0;
+    int src_wd = src.cols;
+    int src_ht = src.rows;
+    if (offx < 0) {
+      src_x = -offx;
+      offx = 0;
+    }
+    if (offy < 0) {
+      src_y = -offy;
+      offy = 0;
+    }
+    if (src.cols + offx - src_x > dst.cols) {
+      // if (src_wd + offx - src_x > dst.cols) {
+      src_wd = dst.cols - offx + src_x;
+    }
+    if (src.rows + offy - src_y > dst.rows) {
+      // if (src_ht + offy > dst.rows) {
+      src_ht = dst.rows - offy + src_y;
+    }
+    src_wd -= src_x;
+    src_ht -= src_y;
+
+    VLOG(2) << "src " << src_x << " " << src_y << ", " << src_wd << " "
+            << src_ht << ", offxy " << offx << " " << offy << ", src "
+            << src.cols << " " << src.rows << ", dst " << dst.cols << " "
+            << dst.rows;
+    cv::Mat src_clipped = src(cv::Rect(src_x, src_y, src_wd, src_ht));
+
+    roi = cv::Rect(offx, offy, src_clipped.cols, src_clipped.rows);
+
+    cv::Mat dst_roi = dst(roi);
+    {
+      STAGE_TIMER("render_copy");
+      src_clipped.copyTo(dst_roi);
+    }
+
+    // draw rectangle around the roi
+    if (true) {
+      cv::Rect roi2 = cv::Rect(offx - 1, offy - 1, src_clipped.cols + 2,
+                               src_clipped.rows + 2);
+      cv::rectangle(dst, roi2, cv::Scalar(165, 175, 150), 1);
+    }
+
+    return true;
+  }
+
+  /*
+    Figure out the zoom from the auto resized image and multiply the user
+    specified zoom before handing the image to this pos is normalized 0.0-1.0
+
+     ______________
+    |              |
+    |              |
+    |              |
+    |              |
+    |______________|
+
+    IF the source image is scaled so the height is taller than the size sz, then
+    the height has to be limited to sz.height and the roi within src sized and
+    positioned accordingly.
+
+  */
+  static bool getZoomRects(const cv::Size src_size, const cv::Size sz,
+                           const float zoom, const cv::Point2f pos,
+                           cv::Rect &roi, cv::Rect &dst_rect) {
+    cv::Size desired_sz =
+        cv::Size(src_size.width * zoom, src_size.height * zoom);
+
+    cv::Size actual_sz = sz;
+
+    float width_fract = 1.0;
+    if (desired_sz.width > sz.width) {
+      width_fract = (float)sz.width / (float)desired_sz.width;
+    } else {
+      actual_sz.width = desired_sz.width;
+    }
+
+    float height_fract = 1.0;
+    if (desired_sz.height > sz.height) {
+      height_fract = (float)sz.height / (float)desired_sz.height;
+    } else {
+      actual_sz.height = desired_sz.height;
+    }
+
+    // offset is in the desired_sz scale, need to scale it down
+    roi = cv::Rect(); // = cv::Rect(0, 0, src.cols, src.rows);
+
+    roi.width = width_fract * src_size.width;
+    roi.height = height_fract * src_size.height;
+
+    roi.x = 0; // (src.cols - roi.width) * pos.x;
+    roi.y = 0; //(src.rows - roi.height) * pos.y;
+
+    // roi.y = src.rows * (pos.y - 0.5);
+
+    int offx = 0;
+    // these are the coordinates if the image had been blown up at full res
+    // so they are valid if the zoomed image is smaller than the dst sz
+    const float full_offx = -(pos.x * desired_sz.width - sz.width / 2);
+    if (sz.width != actual_sz.width)
+      offx = full_offx;
+    else {
+      roi.x = -src_size.width * (float)full_offx /
+              (float)desired_sz.width; //  -(pos.x * src.size().width);
+      VLOG(2) << roi.x;
+
+      if (roi.x < 0) {
+
+        int new_roi_width = roi.width + roi.x;
+        int new_actual_sz_width =
+            actual_sz.width * (float)(new_roi_width) / (float)roi.width;
+        offx = actual_sz.width - new_actual_sz_width;
+        actual_sz.width = new_actual_sz_width;
+
+        roi.width = new_roi_width;
+        roi.x = 0;
+
+        // TBD adjust offx and actual_sz
+        VLOG(3) << offx << " " << actual_sz.width << ", roi " << roi.x << " "
+                << roi.width;
+      }
+
+      if (roi.x + roi.width > src_size.width) {
+        int new_roi_width = src_size.width - roi.x;
+        actual_sz.width *= (float)(new_roi_width) / (float)roi.width;
+        roi.width = new_roi_width;
+      }
+    }
+
+    int offy = 0;
+    const float full_offy = -(pos.y * desired_sz.height - sz.height / 2);
+    if (sz.height != actual_sz.height)
+      offy = full_offy;
+    else {
+      roi.y = -src_size.height * (float)full_offy /
+              (float)desired_sz.height; //  -(pos.y * src.size().height);
+      VLOG(2) << roi.y;
+
+      if (roi.y < 0) {
+
+        int new_roi_height = roi.height + roi.y;
+        int new_actual_sz_height =
+            actual_sz.height * (float)(new_roi_height) / (float)roi.height;
+        offy = actual_sz.height - new_actual_sz_height;
+        actual_sz.height = new_actual_sz_height;
+
+        roi.height = new_roi_height;
+        roi.y = 0;
+
+        VLOG(3) << offy << " " << actual_sz.height << ", roi " << roi.y << " "
+                << roi.height;
+      }
+
+      if (roi.y + roi.height > src_size.height) {
+        int new_roi_height = src_size.height - roi.y;
+        actual_sz.height *= (float)(new_roi_height) / (float)roi.height;
+        roi.height = new_roi_height;
+      }
+    }
+
+    dst_rect = cv::Rect(offx, offy, actual_sz.width, actual_sz.height);
+    VLOG(2) << sz.width << " " << sz.height << ", " << actual_sz.width << " "
+            << actual_sz.height << " " << zoom;
+    return (roi.width > 0) && (roi.height > 0);
+  }
+
+  // for copying a resized image into a 4 channel display image
+  static void matchChannels(cv::Mat &im, const int cn) {
+    if ((cn != 4) || (im.channels() == 4))
+      return;
+    cv::cvtColor(im, im, (im.channels() == 1) ? cv::COLOR_GRAY2BGRA
+                                              : cv::COLOR_BGR2BGRA);
+  }
+
+  /* Clear dst to sz and draw roi of src into dst_rect of it, straight from
+   * the src roi with the resampler, cv::resize only for hq and the layouts
+   * the resampler doesn't handle. A 4 channel 8 bit dst is kept whatever
+   * src is, it is a display image drawn into directly.
+   */
+  void drawZoomed(const cv::Mat &src, const cv::Rect &roi, cv::Mat &dst,
+                  const cv::Size sz, const cv::Rect &dst_rect,
+                  Resampler &resampler, const bool hq) {
+    // reuse whatever dst the caller got from the pool
+    const bool to_display =
+        (dst.type() == CV_8UC4) && (src.depth() == CV_8U);
+    if ((dst.size() != sz) || ((dst.type() != src.type()) && !to_display))
+      dst.create(sz, src.type());
+    dst.setTo(cv::Scalar::all(0));
+    if ((roi.width <= 0) || (roi.height <= 0))
+      return;
+
+    bool blitted = false;
+    if (hq) {
+      // area averages every source pixel when shrinking, cubic is sharper
+      // than linear when enlarging
+      STAGE_TIMER("clipzoom_hq");
+      const int mode = (dst_rect.width < roi.width) ? cv::INTER_AREA
+                                                      : cv::INTER_CUBIC;
+      cv::Mat resized;
+      cv::resize(src(roi), resized, dst_rect.size(), 0, 0, mode);
+      matchChannels(resized, dst.channels());
+      cv::Rect rendered_roi;
+      renderImage(resized, dst, rendered_roi, dst_rect.x, dst_rect.y);
+    } else {
+      STAGE_TIMER("clipzoom_resize");
+      blitted = resampler.blit(src, roi, dst, dst_rect, smooth);
+    }
+    if (blitted) {
+      // draw rectangle around the roi
+      const cv::Rect vis = dst_rect & cv::Rect(0, 0, dst.cols, dst.rows);
+      cv::rectangle(dst,
+                    cv::Rect(vis.x - 1, vis.y - 1, vis.width + 2,
+                             vis.height + 2),
+                    cv::Scalar(165, 175, 150), 1);
+    } else if (!hq) {
+      const int mode = smooth ? cv::INTER_LINEAR : cv::INTER_NEAREST;
+      cv::Mat resized;
+      cv::resize(src(roi), resized, dst_rect.size(), 0, 0, mode);
+      matchChannels(resized, dst.channels());
+      cv::Rect rendered_roi;
+      renderImage(resized, dst, rendered_roi, dst_rect.x, dst_rect.y);
+    }
+  }
+
+  bool clipZoom(const cv::Mat &src, cv::Mat &dst, const cv::Size sz,
+                const float zoom, const cv::Point2f pos,
+                Resampler &resampler, cv::Rect *src_roi = NULL,
+                cv::Rect *dst_roi = NULL, const bool hq = false) {
+    cv::Rect roi;
+    cv::Rect dst_rect;
+    if (!getZoomRects(src.size(), sz, zoom, pos, roi, dst_rect))
+      roi = cv::Rect();
+    drawZoomed(src, roi, dst, sz, dst_rect, resampler, hq);
+
+    // the part of src shown and where, for saving the roi image
+    if ((roi.width > 0) && (roi.height > 0)) {
+      if (src_roi != NULL)
+        *src_roi = roi;
+      if (dst_roi != NULL)
+        *dst_roi = dst_rect;
+    }
+#if 0 
+  if ((actual_sz.height < sz.height) || (actual_sz.width < sz.width)) {
+    dst = cv::Mat(sz, resized.type(), cv::Scalar::all(0));
+    
+    cv::Rect roi = cv::Rect( (sz.width - resized.cols)/2, (sz.height - resized.rows)/2 ,
+        resized.cols, resized.rows );
+    
+    cv::Mat dst_roi = dst(roi);
+    resized.copyTo(dst_roi);
+
+  } else {
+    dst = resized;
+  }
+#endif
+
+    return true;
+  }
+
+  /* resize the image into a new image of a fixed size, automatically scale it
+   * down to fit
+   */
+  static bool resizeImage(const cv::Mat &tmp0, cv::Mat &tmp_aspect,
+                          const cv::Size sz, const float max_scale) {
+    const cv::Size tmp_sz = getScaledSize(tmp0.size(), sz, max_scale);
+
+    // int mode = cv::INTER_NEAREST;
+    // int mode = cv::INTER_CUBIC;
+    int mode = cv::INTER_LINEAR;
+
+    STAGE_TIMER("resize");
+    cv::resize(tmp0, tmp_aspect, tmp_sz, 0, 0, mode);
+    return true;
+  }
+
+  /* the size resizeImage will produce for a source image of src_sz
+   */
+  static cv::Size getScaledSize(const cv::Size src_sz, const cv::Size sz,
+                                const float max_scale) {
+    const float aspect_0 = (float)src_sz.width / (float)src_sz.height;
+    const float aspect_1 = (float)sz.width / (float)sz.height;
+
+    cv::Size tmp_sz = sz;
+
+    // TBD could have epsilon defined by 1 pixel width
+    if (aspect_0 > aspect_1) {
+      tmp_sz.height = tmp_sz.width / aspect_0;
+    } else if (aspect_0 < aspect_1) {
+      tmp_sz.width = tmp_sz.height * aspect_0;
+    }
+
+    VLOG(2) << src_sz.width << " " << src_sz.height << " * " << max_scale
+            << " -> " << tmp_sz.width << " " << tmp_sz.height;
+    // make sure not to upscale the image too much
+    if (tmp_sz.width > src_sz.width * max_scale) {
+      tmp_sz.width = src_sz.width * max_scale;
+      tmp_sz.height = src_sz.height * max_scale;
+    }
+    // if (tmp_sz.height > src_sz.height * max_scale) {
+    //  tmp_sz.width = src_sz.width * max_scale;
+    //  tmp_sz.height = src_sz.height * max_scale;
+    //}
+    return tmp_sz;
+  }
+
+  /* The largest jpeg decoder scale down (1, 2, 4 or 8) that still leaves at
+   * least as many pixels as the scaled frame needs. Both orientations are
+   * checked because imread rotates according to the exif data, which the
+   * header size doesn't account for.
+   */
+  static int getReduceFactor(const cv::Size full_sz, const cv::Size sz,
+                             const float max_scale) {
+    const cv::Size target = getScaledSize(full_sz, sz, max_scale);
+    const cv::Size target_rot = getScaledSize(
+        cv::Size(full_sz.height, full_sz.width), sz, max_scale);
+    const int need_width = std::max(target.width, target_rot.height);
+    const int need_height = std::max(target.height, target_rot.width);
+    int factor = 8;
+    while ((factor > 1) && ((full_sz.width / factor < need_width) ||
+                            (full_sz.height / factor < need_height)))
+      factor /= 2;
+    return factor;
+  }
+
+  /* Decode name fit into sz, at a reduced jpeg scale if that is still
+   * large enough. header_size and is_jpeg are read from the file unless
+   * header_size is already known, from the file index. orig is only set
+   * when the whole image had to be decoded anyway.
+   */
+  static bool decodeScaled(const std::string &name, cv::Mat &orig,
+                           cv::Mat &scaled, cv::Size &full_size,
+                           const MappedFile *mapped, cv::Size &header_size,
+                           bool &is_jpeg, const cv::Size sz,
+                           const float max_scale) {
+    if ((header_size.width == 0) &&
+        !readImageSize(name, header_size, is_jpeg)) {
+      header_size = cv::Size();
+      is_jpeg = false;
+    }
+    int factor = 1;
+    if (is_jpeg)
+      factor = getReduceFactor(header_size, sz, max_scale);
+
+    if (factor == 1) {
+      orig = timedImread(name, mapped);
+      if (orig.empty())
+        return false;
+      full_size = orig.size();
+      resizeImage(orig, scaled, sz, max_scale);
+      return true;
+    }
+
+    int flags = cv::IMREAD_REDUCED_COLOR_2;
+    if (factor == 4)
+      flags = cv::IMREAD_REDUCED_COLOR_4;
+    else if (factor == 8)
+      flags = cv::IMREAD_REDUCED_COLOR_8;
+    cv::Mat reduced;
+    {
+      STAGE_TIMER("imread_reduced");
+      reduced = readImage(name, mapped, flags);
+    }
+    if (reduced.empty())
+      return false;
+
+    full_size = header_size;
+    // exif orientation swapped the axes
+    if ((reduced.cols > reduced.rows) != (header_size.width > header_size.height))
+      full_size = cv::Size(header_size.height, header_size.width);
+    VLOG(2) << name << " decoded at 1/" << factor << " " << reduced.cols << " "
+            << reduced.rows << " of " << full_size.width << " "
+            << full_size.height;
+    STAGE_TIMER("resize");
+    cv::resize(reduced, scaled, getScaledSize(full_size, sz, max_scale), 0, 0,
+               cv::INTER_LINEAR);
+    return true;
+  }
+
+  // imread, or imdecode straight from the mapped file if there is one, or
+  // the frame of a video
+  static cv::Mat readImage(const std::string &name, const MappedFile *mapped,
+                           const int flags = cv::IMREAD_COLOR) {
+    if ((mapped != NULL) && mapped->isOpen())
+      return mapped->decode(flags);
+    std::string path;
+    int frame;
+    if (VideoFrames::parseFrameName(name, path, frame))
+      return VideoFrames::get().read(name);
+    return cv::imread(name, flags);
+  }
+
+  // full resolution with its time recorded
+  static cv::Mat timedImread(const std::string &name,
+                             const MappedFile *mapped = NULL) {
+    STAGE_TIMER("imread");
+    return readImage(name, mapped);
+  }
+
+  static cv::Mat decodeFull(const FrameEntry &entry) {
+    return timedImread(entry.name, entry.mapped.get());
+  }
+
+  /* The preview embedded in a jpeg's exif turned upright, header_size is
+   * the jpeg's. It is kept at its own size and only enlarged when drawn,
+   * replaced entries are never freed so each one stays in memory.
+   * TBD some cameras letterbox it to 4:3 or 16:9 regardless of the image.
+   */
+  static bool decodeExifPreview(const ExifInfo &exif,
+                                const cv::Size header_size, cv::Mat &scaled,
+                                cv::Size &full_size) {
+    if (exif.preview.empty() || (header_size.width == 0))
+      return false;
+    STAGE_TIMER("exif_decode");
+    // the preview has no exif of its own to orient it by
+    const cv::Mat thumb =
+        cv::imdecode(cv::Mat(1, exif.preview.size(), CV_8UC1,
+                             (void *)&exif.preview[0]),
+                     cv::IMREAD_COLOR | cv::IMREAD_IGNORE_ORIENTATION);
+    if (thumb.empty())
+      return false;
+    applyOrientation(thumb, scaled, exif.orientation);
+    full_size = getOrientedSize(header_size, exif.orientation);
+    return true;
+  }
+
+  // index, file name and the stage timings over the rendered frame
+  void drawHud(cv::Mat &dst, const int ind, const std::string &name) {
+    std::stringstream ss;
+    ss << ind << "/" << getNum();
+    cv::putText(dst, ss.str(), cv::Point(10, 10), 1, 1,
+                cv::Scalar(255, 200, 210));
+    cv::putText(dst, name, cv::Point(100, 10), 1, 1, cv::Scalar::all(255));
+    Stats::get().drawHud(dst, 28);
+  }
+
+  /* The overview, drawing only the rows shown and those only from the
+   * atlas. Cells not in it yet are left gray and asked for, the ones shown
+   * first and then a screen below and above, and getFrame is called again
+   * as they are made. A frame is one copy from the atlas per visible cell,
+   * wherever in the list it is scrolled to.
+   */
+  cv::Mat renderGrid(const int ind) {
+    STAGE_TIMER("grid");
+    const boost::shared_ptr<const FrameOrder> o = getOrder();
+    const int num = o->slots.size();
+    if ((num == 0) || (ind < 0) || (ind >= num))
+      return cv::Mat();
+    const int cols = grid_cols;
+    // cells the shape of the window
+    const cv::Size cell(sz.width / cols, sz.height / cols);
+    const int rows = std::max(sz.height / cell.height, 1);
+    grid_atlas.reset(cell, cols * rows * 3);
+    const int gen = grid_atlas.getGeneration();
+
+    // scroll just enough to keep the selected one in view
+    const int row = ind / cols;
+    if (row < grid_top)
+      grid_top = row;
+    else if (row >= grid_top + rows)
+      grid_top = row - rows + 1;
+
+    cv::Mat dst = frame_pool.acquire(sz, CV_8UC3);
+    dst.setTo(cv::Scalar::all(0));
+    std::deque<uint32_t> wanted;
+    // any made while drawing get drawn next time
+    grid_drawn = grid_made;
+    for (int r = 0; r < rows; ++r) {
+      for (int c = 0; c < cols; ++c) {
+        const int i = (grid_top + r) * cols + c;
+        if (i >= num)
+          break;
+        cv::Mat cell_dst = dst(cv::Rect(c * cell.width, r * cell.height,
+                                        cell.width, cell.height));
+        if (!grid_atlas.draw(o->slots[i], cell_dst)) {
+          cell_dst(cv::Rect(2, 2, cell.width - 4, cell.height - 4))
+              .setTo(cv::Scalar::all(40));
+          wanted.push_back(o->slots[i]);
+        }
+      }
+    }
+    grid_missing = !wanted.empty();
+    for (int r = 1; r <= rows; ++r) {
+      const int below = (grid_top + rows - 1 + r) * cols;
+      const int above = (grid_top - r) * cols;
+      for (int c = 0; c < cols; ++c) {
+        if ((below + c < num) && !grid_atlas.has(o->slots[below + c]))
+          wanted.push_back(o->slots[below + c]);
+      }
+      for (int c = 0; (above >= 0) && (c < cols); ++c) {
+        if (!grid_atlas.has(o->slots[above + c]))
+          wanted.push_back(o->slots[above + c]);
+      }
+    }
+    {
+      boost::mutex::scoped_lock l(grid_mutex);
+      grid_wanted.swap(wanted);
+      grid_wanted_gen = gen;
+    }
+    grid_cond.notify_all();
+
+    cv::rectangle(dst,
+                  cv::Rect((ind % cols) * cell.width,
+                           (row - grid_top) * cell.height, cell.width,
+                           cell.height),
+                  cv::Scalar::all(255), 2);
+    if (show_hud)
+      drawHud(dst, ind, entries[o->slots[ind]].name);
+    return dst;
+  }
+
+  // makes the thumbnails renderGrid wants, from the scaled frames
+  void gridThread() {
+    while (true) {
+      uint32_t slot;
+      int gen;
+      {
+        boost::mutex::scoped_lock l(grid_mutex);
+        while (continue_loading && grid_wanted.empty())
+          grid_cond.wait(l);
+        if (!continue_loading)
+          return;
+        slot = grid_wanted.front();
+        grid_wanted.pop_front();
+        gen = grid_wanted_gen;
+      }
+      // the cells may have been resized since it was wanted
+      const cv::Size cell = grid_atlas.getCellSize();
+      if ((gen != grid_atlas.getGeneration()) || (cell.width <= 4) ||
+          (cell.height <= 4) || grid_atlas.has(slot))
+        continue;
+      const FrameEntry entry = getSlot(slot);
+      cv::Mat scaled = entry.scaled;
+      // video frames are read whole just for their cell
+      if (scaled.empty())
+        scaled = decodeFull(entry);
+      if (scaled.empty())
+        continue;
+      cv::Mat thumb;
+      {
+        STAGE_TIMER("grid_thumb");
+        cv::resize(scaled, thumb,
+                   getScaledSize(scaled.size(),
+                                 cv::Size(cell.width - 4, cell.height - 4),
+                                 1.0),
+                   0, 0, cv::INTER_AREA);
+      }
+      // a reset meanwhile drops it
+      if (grid_atlas.put(slot, thumb, gen))
+        grid_made++;
+    }
+  }
+
+  /* Start the decode workers and stream the directory listing to them,
+   * returns once everything found has been loaded. The workers keep going
+   * until scan_done is set, for files added later by watchThread.
+   */
+  bool loadAndResizeImages() {
+    for (int j = 0; j < decode_threads; ++j)
+      decode_workers.create_thread(boost::bind(&Images::decodeWorker, this));
+    for (int j = 0; j < decode_threads; ++j)
+      decode_workers.create_thread(boost::bind(&Images::metaWorker, this));
+
+    const bool rv = getFileNames();
+    // decoding everything may take much longer than listing it
+    if (continue_loading) {
+      listed = true;
+      index.save();
+    }
+    finishWatchScan();
+
+    boost::mutex::scoped_lock l(decode_mutex);
+    LOG(INFO) << "found " << files.size() << " files";
+    while (continue_loading && (num_decoded < files.size())) {
+      // pick up any batch publishFrame left pending
+      decode_cond.timed_wait(l, boost::posix_time::milliseconds(50));
+      l.unlock();
+      flushOrder(false);
+      l.lock();
+    }
+    l.unlock();
+    flushOrder(true);
+
+    return rv;
+  } // loadAndResizeImages
+
+  // hand a file to the decode workers
+  void addFile(const std::string &name) {
+    {
+      boost::mutex::scoped_lock l(decode_mutex);
+      undecoded.insert(files.size());
+      files.push_back(name);
+    }
+    decode_cond.notify_one();
+  }
+
+  // an image, or a video which a decode worker indexes into its frames
+  void addPath(const std::string &name) {
+    if (isImageName(name) || isVideoName(name))
+      addFile(name);
+  }
+
+  // files are decoded outwards from this one from now on
+  void setDecodeCenter(const size_t file_ind) {
+    boost::mutex::scoped_lock l(decode_mutex);
+    decode_center = file_ind;
+  }
+
+  // the undecoded file nearest decode_center, ties going forward,
+  // decode_mutex must be held
+  size_t takeNextDecode() {
+    std::set<size_t>::iterator it = undecoded.lower_bound(decode_center);
+    if (it != undecoded.begin()) {
+      std::set<size_t>::iterator before = it;
+      --before;
+      if ((it == undecoded.end()) ||
+          (decode_center - *before < *it - decode_center))
+        it = before;
+    }
+    const size_t file_ind = *it;
+    undecoded.erase(it);
+    return file_ind;
+  }
+
+  /* Append a decoded frame, it shows up in the order the next time that is
+   * merged. ind is left alone, getFrame moves it to follow the image it
+   * showed last.
+   */
+  void publishFrame(const std::string &name, const cv::Mat &scaled,
+                    const cv::Size full_size,
+                    const boost::shared_ptr<const MappedFile> &mapped,
+                    const size_t file_ind,
+                    const boost::shared_ptr<TilePyramid> &tiles,
+                    const bool preview = false) {
+    FrameEntry entry;
+    entry.name = name;
+    entry.full_size = full_size;
+    entry.mapped = mapped;
+    entry.file_ind = file_ind;
+    entry.tiles = tiles;
+    entry.preview = preview;
+    if (preview) {
+      boost::mutex::scoped_lock l(preview_mutex);
+      previews[name] = scaled;
+    } else {
+      entry.scaled = scaled;
+    }
+    if (!appendEntry(entry)) {
+      if (preview)
+        releasePreview(name);
+      return;
+    }
+    // once loaded the rare new file (from watching) goes in right away
+    flushOrder(loaded);
+  }
+
+  void releasePreview(const std::string &name) {
+    boost::mutex::scoped_lock l(preview_mutex);
+    previews.erase(name);
+  }
+
+  // entries[slot] with the pixels of a preview filled in, which are empty
+  // if it was just replaced
+  FrameEntry getSlot(const uint32_t slot) {
+    FrameEntry entry = entries[slot];
+    if (entry.preview) {
+      boost::mutex::scoped_lock l(preview_mutex);
+      std::map<std::string, cv::Mat>::const_iterator it =
+          previews.find(entry.name);
+      if (it != previews.end())
+        entry.scaled = it->second;
+    }
+    return entry;
+  }
+
+  // to be merged by the next flushOrder, false if there is no room
+  bool appendEntry(const FrameEntry &entry) {
+    const size_t slot = entries.append(entry);
+    if (slot >= entries.capacity()) {
+      LOG(ERROR) << CLERR << "too many frames, dropping " << CLNRM
+                 << entry.name;
+      return false;
+    }
+    boost::mutex::scoped_lock l(order_mutex);
+    pending_slots.push_back(slot);
+    return true;
+  }
+
+  int64_t getSortKey(const FileMeta &meta) const {
+    if (sort_mode == SORT_DATE)
+      return meta.date;
+    if (sort_mode == SORT_SIZE)
+      return meta.size;
+    return meta.pixels;
+  }
+
+  // files the header pass hasn't reached yet go after the rest,
+  // order_mutex must be held
+  bool slotLess(const uint32_t a, const uint32_t b) const {
+    if (sort_mode != SORT_NAME) {
+      const size_t ia = entries[a].file_ind;
+      const size_t ib = entries[b].file_ind;
+      const FileMeta ma = (ia < file_meta.size()) ? file_meta[ia] : FileMeta();
+      const FileMeta mb = (ib < file_meta.size()) ? file_meta[ib] : FileMeta();
+      if (ma.known != mb.known)
+        return ma.known;
+      if (ma.known && (getSortKey(ma) != getSortKey(mb)))
+        return getSortKey(ma) < getSortKey(mb);
+    }
+    return naturalLess(entries[a].name, entries[b].name);
+  }
+
+  void setFileMeta(const size_t file_ind, const FileMeta &meta) {
+    boost::mutex::scoped_lock l(order_mutex);
+    if (file_ind >= file_meta.size())
+      file_meta.resize(file_ind + 1);
+    file_meta[file_ind] = meta;
+    if (sort_mode != SORT_NAME)
+      resort = true;
+  }
+
+  /* Merge the pending entries into a new order and publish it, each merge
+   * copies the whole order so while loading they are batched unless force.
+   * After the sort keys change everything is sorted again, which is
+   * batched longer.
+   */
+  void flushOrder(const bool force) {
+    boost::mutex::scoped_lock l(order_mutex);
+    if (pending_slots.empty() && !resort)
+      return;
+    const boost::posix_time::ptime now =
+        boost::posix_time::microsec_clock::universal_time();
+    const boost::shared_ptr<const FrameOrder> cur = getOrder();
+    if (!force && (cur->slots.size() > 256) &&
+        (now - last_order_flush <
+         boost::posix_time::milliseconds(resort ? 250 : 20)))
+      return;
+
+    std::sort(pending_slots.begin(), pending_slots.end(),
+              boost::bind(&Images::slotLess, this, boost::placeholders::_1,
+                          boost::placeholders::_2));
+    std::vector<uint32_t> replaced;
+    uint32_t max_slot = 0;
+    for (size_t i = 0; i < pending_slots.size(); ++i) {
+      const uint32_t slot = pending_slots[i];
+      max_slot = std::max(max_slot, slot);
+      std::map<std::string, uint32_t>::iterator it =
+          slot_by_name.find(entries[slot].name);
+      if (it != slot_by_name.end()) {
+        // a preview that lost the race with the decode is dropped
+        if (entries[slot].preview && !entries[it->second].preview) {
+          replaced.push_back(slot);
+          releasePreview(entries[slot].name);
+          continue;
+        }
+        if (entries[it->second].preview && !entries[slot].preview)
+          releasePreview(entries[slot].name);
+        replaced.push_back(it->second);
+        it->second = slot;
+      } else {
+        slot_by_name[entries[slot].name] = slot;
+      }
+    }
+    std::sort(replaced.begin(), replaced.end());
+    // including any replaced within this batch
+    std::vector<uint32_t> added;
+    added.reserve(pending_slots.size());
+    for (size_t i = 0; i < pending_slots.size(); ++i) {
+      if (!std::binary_search(replaced.begin(), replaced.end(),
+                              pending_slots[i]))
+        added.push_back(pending_slots[i]);
+    }
+
+    std::vector<uint32_t> kept;
+    kept.reserve(cur->slots.size());
+    for (size_t i = 0; i < cur->slots.size(); ++i) {
+      if (!std::binary_search(replaced.begin(), replaced.end(),
+                              cur->slots[i]))
+        kept.push_back(cur->slots[i]);
+    }
+
+    boost::shared_ptr<FrameOrder> next(new FrameOrder);
+    next->version = cur->version + 1;
+    next->slots.resize(kept.size() + added.size());
+    if (resort) {
+      std::copy(added.begin(), added.end(),
+                std::copy(kept.begin(), kept.end(), next->slots.begin()));
+      std::sort(next->slots.begin(), next->slots.end(),
+                boost::bind(&Images::slotLess, this, boost::placeholders::_1,
+                            boost::placeholders::_2));
+      resort = false;
+    } else {
+      std::merge(kept.begin(), kept.end(), added.begin(), added.end(),
+                 next->slots.begin(),
+                 boost::bind(&Images::slotLess, this, boost::placeholders::_1,
+                             boost::placeholders::_2));
+    }
+    next->rank.resize(std::max((size_t)max_slot + 1, cur->rank.size()),
+                      NO_RANK);
+    for (size_t i = 0; i < next->slots.size(); ++i)
+      next->rank[next->slots[i]] = i;
+
+    boost::atomic_store(&order, boost::shared_ptr<const FrameOrder>(next));
+    pending_slots.clear();
+    last_order_flush = now;
+  }
+
+  /* decode and resize files nearest the one being viewed first, so jumping
+   * far ahead of the load only waits for that image. Distance is by
+   * position in files, which is the display order within each directory.
+   */
+  void decodeWorker() {
+    while (true) {
+      std::string name;
+      size_t file_ind;
+      {
+        boost::mutex::scoped_lock l(decode_mutex);
+        while (continue_loading && !scan_done && undecoded.empty())
+          decode_cond.wait(l);
+        if (!continue_loading || undecoded.empty())
+          return;
+        file_ind = takeNextDecode();
+        name = files[file_ind];
+      }
+
+      if (isVideoName(name))
+        publishVideo(name, file_ind);
+      else
+        decodeFile(name, file_ind);
+
+      {
+        boost::mutex::scoped_lock l(decode_mutex);
+        num_decoded++;
+        progress = (float)num_decoded / (float)files.size();
+      }
+      decode_cond.notify_all();
+    }
+  }
+
+  // decode one image and publish it
+  void decodeFile(const std::string &name, const size_t file_ind) {
+    // TBD only store the names in first pass, then load in second?
+    cv::Mat orig;
+    cv::Mat scaled;
+    cv::Size full_size;
+    int64_t mtime = 0;
+    uint64_t file_size = 0;
+    const bool have_stat = ThumbCache::statFile(name, mtime, file_size);
+    boost::shared_ptr<MappedFile> mapped;
+    if (mmap_originals) {
+      mapped.reset(new MappedFile);
+      if (!mapped->open(name))
+        mapped.reset();
+    }
+    bool too_big = false;
+    if (!(have_stat &&
+          thumbs.lookup(name, mtime, file_size, scaled, full_size))) {
+      // the header pass indexes the file, it may not have got to it yet
+      cv::Size header_size;
+      bool is_jpeg = false;
+      int64_t taken = 0;
+      if (have_stat)
+        index.lookupFile(name, file_size, mtime, header_size, is_jpeg, taken);
+      if ((header_size.width == 0) &&
+          !readImageSize(name, header_size, is_jpeg)) {
+        header_size = cv::Size();
+        is_jpeg = false;
+      }
+      too_big =
+          (int64_t)header_size.width * header_size.height > max_decode_pixels;
+      if (too_big) {
+        full_size = header_size;
+      } else {
+        decodeScaled(name, orig, scaled, full_size, mapped.get(), header_size,
+                     is_jpeg, sz, max_scale);
+        if (have_stat && !scaled.empty())
+          thumbs.add(name, mtime, file_size, full_size, scaled);
+      }
+    }
+
+    if (too_big) {
+      // the tile thread publishes it once there is a pyramid to make the
+      // scaled frame from
+      if (!have_stat || tile_dir.empty()) {
+        LOG(WARNING) << " too big to decode without tiles " << name;
+        return;
+      }
+      FrameEntry job;
+      job.name = name;
+      job.full_size = full_size;
+      job.file_ind = file_ind;
+      job.tiles.reset(
+          new TilePyramid(tile_dir, name, mtime, file_size, full_size));
+      queueTiles(job);
+    } else if (scaled.data == NULL) { //.empty()) {
+      LOG(WARNING) << " not an image? " << name;
+    } else {
+      VLOG(2) << " loaded image " << name;
+      boost::shared_ptr<TilePyramid> tiles;
+      if (have_stat && !tile_dir.empty() && (tile_min_pixels > 0) &&
+          ((int64_t)full_size.width * full_size.height >= tile_min_pixels)) {
+        tiles.reset(
+            new TilePyramid(tile_dir, name, mtime, file_size, full_size));
+      }
+      // a rewritten file may have a stale full frame
+      frames_orig.erase(name);
+      // keep the full frame only while there is room for it, the
+      // prefetcher decides what is worth evicting for
+      if (!tiles)
+        frames_orig.put(name, orig, true);
+      publishFrame(name, scaled, full_size, mapped, file_ind, tiles);
+      notifyPrefetch();
+      // shown scaled meanwhile, the tile thread reads the file again a strip
+      // at a time rather than orig being kept for it
+      if (tiles && !tiles->load()) {
+        FrameEntry job;
+        job.name = name;
+        job.scaled = scaled;
+        job.full_size = full_size;
+        job.tiles = tiles;
+        queueTiles(job);
+      }
+    }
+  }
+
+  // job.scaled is empty if it is still to be published
+  void queueTiles(const FrameEntry &job) {
+    {
+      boost::mutex::scoped_lock l(tile_mutex);
+      tile_jobs.push_back(job);
+    }
+    tile_cond.notify_one();
+  }
+
+  void tileThread() {
+    while (true) {
+      FrameEntry job;
+      {
+        boost::mutex::scoped_lock l(tile_mutex);
+        // wake up periodically to notice continue_loading
+        while (continue_loading && tile_jobs.empty())
+          tile_cond.timed_wait(l, boost::posix_time::milliseconds(200));
+        if (!continue_loading)
+          return;
+        job = tile_jobs.front();
+        tile_jobs.pop_front();
+      }
+      if (!job.tiles->load() && !job.tiles->build(job.name))
+        continue;
+      if (!job.scaled.empty())
+        continue;
+      const cv::Size scaled_size = getScaledSize(job.full_size, sz, max_scale);
+      const cv::Mat level =
+          job.tiles->getLevelAtLeast(scaled_size, &tile_cache);
+      if (level.empty())
+        continue;
+      cv::resize(level, job.scaled, scaled_size, 0, 0, cv::INTER_AREA);
+      VLOG(2) << " loaded image " << job.name << " from its tiles";
+      publishFrame(job.name, job.scaled, job.full_size, job.mapped,
+                   job.file_ind, job.tiles);
+      notifyPrefetch();
+    }
+  }
+
+  /* Index a video and add an entry for each frame without decoding any,
+   * they are read into frames_orig by the prefetcher only while near the
+   * current one.
+   */
+  void publishVideo(const std::string &path, const size_t file_ind) {
+    cv::Size size;
+    const int num = VideoFrames::get().open(path, size);
+    if (num == 0) {
+      LOG(WARNING) << " not a video? " << path;
+      return;
+    }
+    VLOG(2) << " indexed video " << path;
+    for (int i = 0; (i < num) && continue_loading; ++i) {
+      FrameEntry entry;
+      entry.name = VideoFrames::getFrameName(path, i);
+      entry.full_size = size;
+      entry.file_ind = file_ind;
+      entry.preview = false;
+      if (!appendEntry(entry))
+        break;
+    }
+    flushOrder(loaded);
+    notifyPrefetch();
+  }
+
+  /* Read the header of every file in order, or take what the file index
+   * has from the last run, for the sort keys and to index it. These are
+   * mostly waiting on the disk so there are as many as decode workers.
+   * Files no worker has taken yet also get the preview embedded in their
+   * exif published, so everything can be browsed at low resolution while
+   * the decoding catches up. flushOrder keeps a preview from replacing a
+   * decoded frame should a worker win anyway.
+   */
+  void metaWorker() {
+    while (true) {
+      std::string name;
+      size_t file_ind;
+      bool want_preview;
+      {
+        boost::mutex::scoped_lock l(decode_mutex);
+        // addFile only wakes one thread, which may be a decode worker
+        while (continue_loading && !scan_done && (next_meta >= files.size()))
+          decode_cond.timed_wait(l, boost::posix_time::milliseconds(50));
+        if (!continue_loading || (next_meta >= files.size()))
+          return;
+        file_ind = next_meta++;
+        name = files[file_ind];
+        want_preview =
+            exif_previews && !loaded && (undecoded.count(file_ind) > 0);
+      }
+
+      FileMeta meta;
+      int64_t mtime = 0;
+      cv::Size header_size;
+      bool is_jpeg = false;
+      int64_t taken = 0;
+      ExifInfo exif;
+      cv::Mat scaled;
+      cv::Size full_size;
+      if (ThumbCache::statFile(name, mtime, meta.size)) {
+        const bool indexed = index.lookupFile(name, meta.size, mtime,
+                                              header_size, is_jpeg, taken);
+        // cached frames are already about as quick
+        if (want_preview &&
+            thumbs.lookup(name, mtime, meta.size, scaled, full_size))
+          want_preview = false;
+        if (!indexed || want_preview) {
+          bool have_header;
+          {
+            STAGE_TIMER("header_read");
+            have_header = readImageSize(name, header_size, is_jpeg, &exif);
+          }
+          taken = exif.taken;
+          if (have_header && !indexed)
+            index.updateFile(name, meta.size, mtime, header_size, is_jpeg,
+                             taken);
+        }
+        meta.date = (taken > 0) ? taken * 1000000000LL : mtime;
+        meta.pixels = (int64_t)header_size.width * header_size.height;
+        meta.known = true;
+        setFileMeta(file_ind, meta);
+      }
+
+      if (want_preview &&
+          decodeExifPreview(exif, header_size, scaled, full_size)) {
+        VLOG(2) << " preview of " << name;
+        publishFrame(name, scaled, full_size,
+                     boost::shared_ptr<const MappedFile>(), file_ind,
+                     boost::shared_ptr<TilePyramid>(), true);
+      }
+
+      bool last;
+      {
+        boost::mutex::scoped_lock l(decode_mutex);
+        last = (++num_meta == files.size());
+      }
+      // the rest are batched with the decoded frames while loading
+      flushOrder(loaded || last);
+    }
+  }
+
+  // the names of every file added so far, sorted
+  std::vector<std::string> getKnownFiles() {
+    std::vector<std::string> known;
+    {
+      boost::mutex::scoped_lock l(decode_mutex);
+      known = files;
+    }
+    std::sort(known.begin(), known.end());
+    return known;
+  }
+
+  // called by scanDir before it lists dir, so nothing written meanwhile
+  // is missed
+  void watchDir(const std::string &dir) {
+    if (watch_fd < 0)
+      return;
+    const int wd =
+        inotify_add_watch(watch_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0) {
+      LOG(WARNING) << CLWRN << "can't watch " << CLNRM << dir;
+      return;
+    }
+    boost::mutex::scoped_lock l(watch_mutex);
+    watched[wd] = dir;
+  }
+
+  // a file written into a watched directory
+  void addWatched(const std::string &name) {
+    boost::mutex::scoped_lock l(watch_mutex);
+    if (watch_scanning) {
+      watch_early.insert(name);
+      return;
+    }
+    VLOG(1) << "new file " << name;
+    addFile(name);
+  }
+
+  // add the events held during the initial scan that it didn't list
+  void finishWatchScan() {
+    if (watch_fd < 0)
+      return;
+    const std::vector<std::string> known = getKnownFiles();
+    boost::mutex::scoped_lock l(watch_mutex);
+    watch_scanning = false;
+    for (std::set<std::string>::const_iterator it = watch_early.begin();
+         it != watch_early.end(); ++it) {
+      if (std::binary_search(known.begin(), known.end(), *it))
+        continue;
+      VLOG(1) << "new file " << *it;
+      addFile(*it);
+    }
+    watch_early.clear();
+    LOG(INFO) << "watching " << watched.size() << " directories";
+  }
+
+  /* The kernel dropped events, so list every watched directory again for
+   * images not added yet.
+   * TBD files rewritten meanwhile keep the old version
+   */
+  void rescanWatched() {
+    std::vector<std::string> dirs;
+    {
+      boost::mutex::scoped_lock l(watch_mutex);
+      for (std::map<int, std::string>::const_iterator it = watched.begin();
+           it != watched.end(); ++it)
+        dirs.push_back(it->second);
+    }
+    LOG(WARNING) << CLWRN << "inotify overflowed, rescanning " << CLNRM
+                 << dirs.size() << " directories";
+    const std::vector<std::string> known = getKnownFiles();
+    for (size_t i = 0; (i < dirs.size()) && continue_loading; ++i) {
+      try {
+        boost::filesystem::directory_iterator end_itr;
+        for (boost::filesystem::directory_iterator itr(dirs[i]);
+             itr != end_itr; ++itr) {
+          const std::string name =
+              joinPath(dirs[i], itr->path().filename().string());
+          if (isImageName(name) &&
+              !std::binary_search(known.begin(), known.end(), name))
+            addWatched(name);
+        }
+      } catch (const boost::filesystem::filesystem_error &ex) {
+        LOG(WARNING) << CLWRN << ex.what() << CLNRM;
+      }
+    }
+  }
+
+  /* Add images written into the watched directories, from the start of the
+   * initial scan until loading is stopped.
+   */
+  // TBD directories created while watching aren't watched
+  void watchThread() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (continue_loading) {
+      // wake up periodically to notice continue_loading
+      struct pollfd pfd;
+      pfd.fd = watch_fd;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, 200) <= 0)
+        continue;
+      const ssize_t len = read(watch_fd, buf, sizeof(buf));
+      for (ssize_t i = 0; i < len;) {
+        const struct inotify_event *event =
+            (const struct inotify_event *)(buf + i);
+        i += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+          rescanWatched();
+          continue;
+        }
+        if ((event->len == 0) || (event->mask & IN_ISDIR))
+          continue;
+        std::string dir;
+        {
+          boost::mutex::scoped_lock l(watch_mutex);
+          std::map<int, std::string>::const_iterator it =
+              watched.find(event->wd);
+          if (it == watched.end())
+            continue;
+          dir = it->second;
+        }
+        const std::string name = joinPath(dir, event->name);
+        if (isImageName(name))
+          addWatched(name);
+      }
+    }
+  }
+
+  void notifyPrefetch() {
+    {
+      boost::mutex::scoped_lock l(prefetch_mutex);
+      prefetch_gen++;
+    }
+    prefetch_cond.notify_all();
+  }
+
+  // record navigation so the prefetcher can follow it
+  void setPrefetchInd(const int new_ind) {
+    const int num = getNum();
+    {
+      boost::mutex::scoped_lock l(prefetch_mutex);
+      if (new_ind == prefetch_ind)
+        return;
+      // shortest way around, so wrapping from the last to the first image
+      // still counts as moving forward
+      int diff = new_ind - prefetch_ind;
+      if (diff > num / 2)
+        diff -= num;
+      else if (diff < -num / 2)
+        diff += num;
+      prefetch_dir = (diff < 0) ? -1 : 1;
+      prefetch_ind = new_ind;
+      prefetch_gen++;
+    }
+    prefetch_cond.notify_all();
+  }
+
+  /* The indices worth having at full resolution in priority order, the
+   * current one first and then twice as many ahead in the direction of travel
+   * as behind, until the expected size fills the cache budget.
+   */
+  std::vector<int> getPrefetchWindow(const int center, const int dir) {
+    std::vector<int> window;
+    const int num = getNum();
+    if (num == 0)
+      return window;
+
+    const size_t frame_bytes =
+        frames_orig.averageBytes(sz.width * sz.height * 3 * 4);
+    const size_t max_frames =
+        std::max((size_t)1, frames_orig.getBudget() / frame_bytes);
+
+    window.push_back(center);
+    int ahead = 0;
+    int behind = 0;
+    while ((window.size() < max_frames) && (window.size() < (size_t)num)) {
+      int offset;
+      if (ahead < 2 * (behind + 1)) {
+        ahead++;
+        offset = ahead * dir;
+      } else {
+        behind++;
+        offset = -behind * dir;
+      }
+      window.push_back(((center + offset) % num + num) % num);
+    }
+    return window;
+  }
+
+  void prefetchThread() {
+    int last_gen = -1;
+    while (continue_loading) {
+      int center;
+      int dir;
+      {
+        boost::mutex::scoped_lock l(prefetch_mutex);
+        while (continue_loading && (prefetch_gen == last_gen))
+          prefetch_cond.wait(l);
+        last_gen = prefetch_gen;
+        center = prefetch_ind;
+        dir = prefetch_dir;
+      }
+
+      const std::vector<int> window = getPrefetchWindow(center, dir);
+      // touch the resident ones lowest priority first so the least
+      // wanted get evicted first
+      for (int i = (int)window.size() - 1; i >= 0; --i)
+        frames_orig.touch(getFileName(window[i]));
+
+      for (size_t i = 0; (i < window.size()) && continue_loading; ++i) {
+        {
+          // start over if the user has moved on
+          boost::mutex::scoped_lock l(prefetch_mutex);
+          if ((prefetch_gen != last_gen) && (prefetch_ind != center))
+            break;
+        }
+        FrameEntry entry;
+        // tiled images are read a window at a time instead, and the decode
+        // workers are about to read the full frames of previews anyway
+        if (!getEntry(window[i], entry) || entry.tiles || entry.preview ||
+            frames_orig.touch(entry.name))
+          continue;
+        VLOG(2) << "prefetching " << window[i] << " " << entry.name;
+        frames_orig.put(entry.name, decodeFull(entry));
+      }
+    }
+  }
+
+  static std::string joinPath(const std::string &dir, const std::string &leaf) {
+    if (dir == "/")
+      return dir + leaf;
+    return dir + "/" + leaf;
+  }
+
+  // identifies the set of images for the on disk caches
+  std::string getSourceKey() {
+    std::stringstream key;
+    for (size_t i = 0; i < roots.size(); ++i) {
+      std::string root = roots[i];
+      try {
+        root = boost::filesystem::canonical(root).string();
+      } catch (const boost::filesystem::filesystem_error &) {
+      }
+      key << ((i > 0) ? "," : "") << root;
+    }
+    if (!list_file.empty())
+      key << ",list " << list_file;
+    if (recursive)
+      key << ",recursive";
+    return key.str();
+  }
+
+  // each file goes to the decode workers as soon as it is found rather than
+  // after the whole listing, publishFrame takes care of the sorting
+  bool getFileNames() {
+    LOG(INFO) << "vimaj loading " << roots.size() << " roots"
+              << (recursive ? " recursively" : "")
+              << (list_file.empty() ? "" : " and the list ") << list_file;
+    bool rv = true;
+    if (!list_file.empty() && !readFileList(list_file))
+      rv = false;
+    // in display order too
+    std::vector<std::string> sorted_roots = roots;
+    std::sort(sorted_roots.begin(), sorted_roots.end(), naturalLess);
+    for (size_t i = 0; (i < sorted_roots.size()) && continue_loading; ++i) {
+      if (boost::filesystem::is_regular_file(sorted_roots[i])) {
+        addPath(sorted_roots[i]);
+        continue;
+      }
+      if (!scanDir(sorted_roots[i]))
+        rv = false;
+    }
+    return rv;
+  }
+
+  bool readFileList(const std::string &list) {
+    std::ifstream file;
+    std::istream *in = &std::cin;
+    if (list != "-") {
+      file.open(list.c_str());
+      if (!file) {
+        LOG(ERROR) << CLERR << "can't read list " << CLNRM << list;
+        return false;
+      }
+      in = &file;
+    }
+    std::string line;
+    while (continue_loading && std::getline(*in, line)) {
+      addPath(line);
+    }
+    return true;
+  }
+
+  /* Add the images in dir, and in its subdirectories if recursive. The
+   * listing from the file index is used if dir hasn't changed since, so
+   * only the directories themselves get a stat.
+   */
+  bool scanDir(const std::string &dir) {
+    int64_t mtime = 0;
+    if (!FileIndex::dirMtime(dir, mtime)) {
+      LOG(ERROR) << "vimaj" << CLERR << " not a directory " << CLNRM << dir;
+      return false;
+    }
+    watchDir(dir);
+
+    IndexedDir listing;
+    if (index.getUnchanged(dir, mtime, listing)) {
+      VLOG(2) << "unchanged " << dir;
+    } else {
+      listing.mtime = mtime;
+      try {
+        boost::filesystem::directory_iterator end_itr;
+        for (boost::filesystem::directory_iterator itr(dir);
+             (itr != end_itr) && continue_loading; ++itr) {
+          const std::string leaf = itr->path().filename().string();
+          // not following symlinked directories, which could loop
+          if (is_directory(itr->symlink_status())) {
+            listing.subdirs.push_back(leaf);
+          } else if (isImageName(leaf) || isVideoName(leaf)) {
+            IndexedFile file;
+            file.name = leaf;
+            listing.files.push_back(file);
+          }
+        }
+      } catch (const boost::filesystem::filesystem_error &ex) {
+        LOG(WARNING) << CLWRN << ex.what() << CLNRM;
+        return false;
+      }
+      // an interrupted listing mustn't be reused as complete
+      if (!continue_loading)
+        return false;
+      std::sort(listing.subdirs.begin(), listing.subdirs.end());
+      std::sort(listing.files.begin(), listing.files.end());
+    }
+    index.setDir(dir, listing);
+
+    // the listing is sorted bytewise for the index, but added in the order
+    // shown so positions in files follow the display while loading,
+    // subdirectories marked by a trailing / to sort as their paths do
+    std::vector<std::string> leaves;
+    for (size_t i = 0; i < listing.files.size(); ++i)
+      leaves.push_back(listing.files[i].name);
+    for (size_t i = 0; recursive && (i < listing.subdirs.size()); ++i)
+      leaves.push_back(listing.subdirs[i] + "/");
+    std::sort(leaves.begin(), leaves.end(), naturalLess);
+    for (size_t i = 0; (i < leaves.size()) && continue_loading; ++i) {
+      const std::string &leaf = leaves[i];
+      if (leaf[leaf.size() - 1] == '/')
+        scanDir(joinPath(dir, leaf.substr(0, leaf.size() - 1)));
+      else
+        addPath(joinPath(dir, leaf));
+    }
+    return true;
+  }
+
+  /////////////////////////////////
+  // the current order, which stays valid for as long as it is held
+  boost::shared_ptr<const FrameOrder> getOrder() const {
+    return boost::atomic_load(&order);
+  }
+
+  bool getEntry(const int ind, FrameEntry &entry) {
+    const boost::shared_ptr<const FrameOrder> o = getOrder();
+    if ((ind < 0) || ((size_t)ind >= o->slots.size()))
+      return false;
+    entry = getSlot(o->slots[ind]);
+    return true;
+  }
+
+  std::string getFileName(const int ind) {
+    const boost::shared_ptr<const FrameOrder> o = getOrder();
+    if ((ind < 0) || ((size_t)ind >= o->slots.size()))
+      return "";
+    return entries[o->slots[ind]].name;
+  }
+
+  cv::Size getFullSize(const int ind) {
+    const boost::shared_ptr<const FrameOrder> o = getOrder();
+    if ((ind < 0) || ((size_t)ind >= o->slots.size()))
+      return cv::Size();
+    return entries[o->slots[ind]].full_size;
+  }
+
+  // from the cache if possible, otherwise decode it now
+  cv::Mat getFullFrame(const FrameEntry &entry) {
+    cv::Mat frame = frames_orig.get(entry.name);
+    if (frame.empty()) {
+      frame = decodeFull(entry);
+      frames_orig.put(entry.name, frame);
+    }
+    return frame;
+  }
+
+  // the pyramid level to render at zoom relative to level 0
+  static int getPyramidLevel(const float zoom) {
+    int level = 0;
+    for (float level_zoom = 0.5; level_zoom >= zoom; level_zoom *= 0.5)
+      level++;
+    return level;
+  }
+
+  // a halving of a scaled frame, built once per frame like those of the
+  // full resolution ones
+  cv::Mat getScaledLevel(const std::string &name, const cv::Mat &scaled,
+                         const int level) {
+    if (level == 0)
+      return scaled;
+    // not there yet or the file has been decoded again since
+    if (scaled_levels.get(name).data != scaled.data)
+      scaled_levels.put(name, scaled);
+    const cv::Mat im = scaled_levels.getLevel(name, level);
+    return im.empty() ? scaled : im;
+  }
+
+  cv::Mat getScaledFrame(int &ind) {
+    const boost::shared_ptr<const FrameOrder> o = getOrder();
+    const int num = o->slots.size();
+    if (num == 0)
+      return cv::Mat();
+    ind = (ind % num + num) % num;
+    return getSlot(o->slots[ind]).scaled;
+  }
+
+  // draw rectangle on image to show current roi
+  void drawRoiRects(cv::Mat &dst, const float aspect) {
+    cv::rectangle(dst, getRoiRect(1, 1.0, aspect), cv::Scalar(0, 0, 0), 1);
+    cv::rectangle(dst, getRoiRect(0, 1.0, aspect), cv::Scalar(255, 255, 255),
+                  1);
+  }
+
+  // target if it is a display image to draw into, else one from the pool
+  cv::Mat acquireDst(const cv::Mat &target, const int type) {
+    if ((target.size() == sz) && (target.type() == CV_8UC4) &&
+        (CV_MAT_DEPTH(type) == CV_8U))
+      return target;
+    return frame_pool.acquire(sz, type);
+  }
+
+  /* Composite only the tiles under the window, from the level with at
+   * least as many pixels as will be displayed.
+   */
+  void renderTiles(const FrameEntry &entry, const ViewParams &params,
+                   RenderScratch &scratch, RenderedView &view,
+                   const bool hq, const cv::Mat &target) {
+    const TilePyramid &tiles = *entry.tiles;
+    const float scaled_cols = entry.scaled.cols;
+    const float full_zoom = params.zoom * scaled_cols / entry.full_size.width;
+    const int level =
+        std::min(getPyramidLevel(full_zoom), tiles.getLevels() - 1);
+    const cv::Size level_size = tiles.getLevelSize(level);
+    cv::Rect roi;
+    cv::Rect dst_rect;
+    view.src = cv::Mat();
+    if (getZoomRects(level_size, sz,
+                     params.zoom * scaled_cols / level_size.width, params.pos,
+                     roi, dst_rect)) {
+      STAGE_TIMER("tiles");
+      view.src = tiles.getRegion(level, roi, &tile_cache);
+    }
+    view.dst = acquireDst(target, CV_8UC3);
+    view.hq = hq;
+    if (view.src.empty()) {
+      view.dst.setTo(cv::Scalar::all(0));
+      view.roi = cv::Rect();
+      view.dst_rect = cv::Rect();
+      return;
+    }
+    view.roi = cv::Rect(0, 0, view.src.cols, view.src.rows);
+    view.dst_rect = dst_rect;
+    view.tile_level = level;
+    view.tile_origin = roi.tl();
+    drawZoomed(view.src, view.roi, view.dst, sz, dst_rect, scratch.resampler,
+               hq);
+  }
+
+  /* Composite one image at the given view, returns false if zoomed in and
+   * the full resolution frame isn't ready within wait_ms, in which case
+   * view is rendered from the scaled frame instead. Drawn into target if
+   * that is a display image.
+   */
+  bool renderView(const FrameEntry &entry, const ViewParams &params,
+                  const int wait_ms, RenderScratch &scratch,
+                  RenderedView &view, const bool hq = false,
+                  const cv::Mat &target = cv::Mat()) {
+    const cv::Mat &scaled = entry.scaled;
+    const double zoom = params.zoom;
+    bool complete = true;
+    const bool video = scaled.empty();
+    // a preview or video frame stands in for a scaled frame this wide
+    const int scaled_cols =
+        (entry.preview || video)
+            ? getScaledSize(entry.full_size, sz, max_scale).width
+            : scaled.cols;
+
+    if ((zoom > 1.0) && entry.tiles && entry.tiles->isReady()) {
+      renderTiles(entry, params, scratch, view, hq, target);
+      drawRoiRects(view.dst, params.roi_aspect);
+      return true;
+    }
+
+    // pick the smallest pyramid level that still has at least as many pixels
+    // as will be displayed, so the resize is proportional to the window
+    // rather than the source.  The scaled frame has all the pixels needed
+    // unless zoomed in past it.
+    cv::Mat src = scaled;
+    if ((zoom > 1.0) || video) {
+      // the tiles of a tiled image aren't built yet, nor is a preview worth
+      // waiting on
+      cv::Mat orig = (entry.tiles || entry.preview)
+                         ? cv::Mat()
+                         : frames_orig.waitFor(entry.name, wait_ms);
+      if (orig.empty()) {
+        // not decoded yet, zoom into the scaled frame instead
+        VLOG(1) << "full resolution " << entry.name << " not ready";
+        complete = false;
+      } else {
+        const float full_zoom = zoom * scaled_cols / (float)orig.cols;
+        src = frames_orig.getLevel(entry.name, getPyramidLevel(full_zoom));
+        if (src.empty())
+          src = orig;
+      }
+    } else if (!entry.preview) {
+      src = getScaledLevel(entry.name, scaled, getPyramidLevel(zoom));
+    }
+    if (src.empty()) {
+      // a video frame not read yet
+      view = RenderedView();
+      view.dst = acquireDst(target, CV_8UC3);
+      view.dst.setTo(cv::Scalar::all(0));
+      view.hq = hq;
+      return false;
+    }
+    // the zoom relative to src that displays the same as zoom relative to
+    // the scaled frame
+    const float scaled_zoom = (float)scaled_cols / (float)src.cols;
+    VLOG(4) << scaled_zoom << " " << zoom << " " << zoom * scaled_zoom
+            << ", " << src.cols << " of " << entry.full_size.width;
+
+    view.src = src;
+    view.roi = cv::Rect();
+    view.dst_rect = cv::Rect();
+    view.dst = acquireDst(target, src.type());
+    view.hq = hq;
+    clipZoom(src, view.dst, sz, zoom * scaled_zoom, params.pos,
+             scratch.resampler, &view.roi, &view.dst_rect, hq);
+
+    drawRoiRects(view.dst, params.roi_aspect);
+
+    cv::Mat &dst = view.dst;
+    if (VLOG_IS_ON(1))
+      cv::circle(dst, cv::Point(dst.cols / 2, dst.rows / 2), 5,
+                 cv::Scalar::all(255), -1);
+    return complete;
+  }
+
+  /* get a rendered frame, from the ones rendered ahead if it is there,
+   * otherwise drawn straight into target if it is a display image
+   */
+  cv::Mat getFrame(int &ind, const double zoom = 1.0,
+                   cv::Point2f pos = cv::Point2f(0.5, 0.5),
+                   const cv::Mat &target = cv::Mat()) {
+    STAGE_TIMER("get_frame");
+    FrameEntry entry;
+    {
+      const boost::shared_ptr<const FrameOrder> o = getOrder();
+      const int num = o->slots.size();
+      if (num == 0)
+        return cv::Mat();
+      int jump_ind;
+      if (!jump_name.empty() && findRank(*o, jump_name, jump_ind)) {
+        ind = jump_ind;
+        jump_name.clear();
+      } else if (!jump_name.empty() && loaded) {
+        // it wasn't an image
+        jump_name.clear();
+      } else if ((o->version != cur_order_version) &&
+                 (cur_slot < o->rank.size()) &&
+                 (o->rank[cur_slot] != NO_RANK)) {
+        // frames inserted since the last call shift the image shown last,
+        // keep ind the same distance from it
+        ind += (int)o->rank[cur_slot] - cur_ind;
+      }
+      cur_order_version = o->version;
+      if (!loaded && (ind < 0)) {
+        // wrapping around to the last image decoded so far isn't the last
+        // one, stay put until the real one is
+        ind = 0;
+        jumpToFile(std::numeric_limits<size_t>::max());
+      } else if (!loaded && (ind >= num)) {
+        ind = num - 1;
+      }
+      ind = (ind % num + num) % num;
+      cur_ind = ind;
+      cur_slot = o->slots[ind];
+      entry = getSlot(cur_slot);
+    }
+    if (grid) {
+      if (!loaded && jump_name.empty())
+        setDecodeCenter(entry.file_ind);
+      return renderGrid(ind);
+    }
+    if (entry.full_size.width == 0)
+      entry.full_size = entry.scaled.size();
+    setPrefetchInd(ind);
+    if (!loaded && jump_name.empty())
+      setDecodeCenter(entry.file_ind);
+
+    ViewParams params;
+    params.zoom = zoom;
+    params.pos = pos;
+    params.roi_aspect = roi_aspect;
+
+    RenderedView view;
+    bool found = false;
+    {
+      boost::mutex::scoped_lock l(render_mutex);
+      if (!(params == render_params)) {
+        // everything rendered ahead is for the old view
+        render_params = params;
+        rendered.clear();
+        render_gen++;
+        render_changed = boost::get_system_time();
+      }
+      std::map<uint32_t, RenderedView>::iterator it = rendered.find(cur_slot);
+      if (it != rendered.end()) {
+        view = it->second;
+        found = true;
+      }
+      if (ind != render_ind) {
+        int diff = ind - render_ind;
+        const int num = getNum();
+        if (diff > num / 2)
+          diff -= num;
+        else if (diff < -num / 2)
+          diff += num;
+        render_dir = (diff < 0) ? -1 : 1;
+        render_ind = ind;
+        render_gen++;
+        render_changed = boost::get_system_time();
+      }
+    }
+    render_cond.notify_all();
+
+    // rather than wait for the full resolution frame show the scaled one
+    // now, the prefetcher is decoding the current frame first and the
+    // caller renders again once refineReady
+    refine_name.clear();
+    refine_tiles.reset();
+    // and the decoded frame when it replaces the preview
+    refine_preview = entry.preview;
+    if (!found &&
+        !renderView(entry, params, 0, ui_scratch, view, false, target)) {
+      refine_name = entry.name;
+      refine_tiles = entry.tiles;
+    }
+    // and the render thread redoes it with the slow filters once still
+    refine_hq = (refine_ms > 0) && !view.hq;
+
+    cur_im = view.src;
+    cur_roi = view.roi;
+    cur_dst_rect = view.dst_rect;
+    cur_tile_level = view.tile_level;
+    cur_tile_origin = view.tile_origin;
+
+    if (!show_hud)
+      return view.dst;
+    if (!found) {
+      // nothing else keeps it
+      drawHud(view.dst, ind, entry.name);
+      return view.dst;
+    }
+    // don't draw on the copy kept for the next time this view is shown
+    cv::Mat dst = frame_pool.acquire(view.dst.size(), view.dst.type());
+    view.dst.copyTo(dst);
+    drawHud(dst, ind, entry.name);
+    return dst;
+  }
+
+  /* The slots to render ahead in priority order, the nearest first in the
+   * direction of travel, up to render_ahead each way and within the budget.
+   */
+  std::vector<uint32_t> getRenderWindow(const int center, const int dir) {
+    std::vector<uint32_t> window;
+    const boost::shared_ptr<const FrameOrder> o = getOrder();
+    const int num = o->slots.size();
+    if (num == 0)
+      return window;
+    const size_t view_bytes = (size_t)sz.width * sz.height * 3;
+    const size_t max_views =
+        std::min(std::max(render_max_bytes / view_bytes, (size_t)1),
+                 (size_t)num);
+    for (int i = 1; (i <= render_ahead) && (window.size() < max_views); ++i) {
+      window.push_back(o->slots[((center + i * dir) % num + num) % num]);
+      if (window.size() < max_views)
+        window.push_back(o->slots[((center - i * dir) % num + num) % num]);
+    }
+    // the current one last, it is normally rendered by getFrame already
+    if (window.size() < max_views)
+      window.push_back(o->slots[(center % num + num) % num]);
+    return window;
+  }
+
+  void renderThread() {
+    RenderScratch scratch;
+    int last_gen = -1;
+    while (continue_loading) {
+      int center;
+      int dir;
+      ViewParams params;
+      {
+        boost::mutex::scoped_lock l(render_mutex);
+        // look again every so often even when nothing changed, for new
+        // frames in the window and full resolution frames arriving
+        while (continue_loading && (render_gen == last_gen)) {
+          if (!render_cond.timed_wait(l, boost::posix_time::milliseconds(200)))
+            break;
+        }
+        last_gen = render_gen;
+        center = render_ind;
+        dir = render_dir;
+        params = render_params;
+      }
+
+      std::vector<uint32_t> window = getRenderWindow(center, dir);
+      {
+        // drop the ones outside the window
+        boost::mutex::scoped_lock l(render_mutex);
+        if (render_gen != last_gen)
+          continue;
+        std::vector<uint32_t> sorted = window;
+        std::sort(sorted.begin(), sorted.end());
+        for (std::map<uint32_t, RenderedView>::iterator it = rendered.begin();
+             it != rendered.end();) {
+          if (std::binary_search(sorted.begin(), sorted.end(), it->first))
+            ++it;
+          else
+            rendered.erase(it++);
+        }
+      }
+
+      for (size_t i = 0; (i < window.size()) && continue_loading; ++i) {
+        {
+          boost::mutex::scoped_lock l(render_mutex);
+          // start over if the view changed or the user moved on
+          if (render_gen != last_gen)
+            break;
+          if (rendered.count(window[i]) > 0)
+            continue;
+        }
+        RenderedView view;
+        bool complete;
+        {
+          STAGE_TIMER("render_ahead");
+          complete = renderView(getSlot(window[i]), params, orig_wait_ms,
+                                scratch, view);
+        }
+        boost::mutex::scoped_lock l(render_mutex);
+        // a zoomed in view without the full resolution frame isn't worth
+        // keeping, getFrame will do better once it has arrived
+        if (complete && (params == render_params))
+          rendered[window[i]] = view;
+      }
+
+      if (refine_ms > 0)
+        refineView(center, params, last_gen, scratch);
+    }
+  }
+
+  /* Once the view hasn't changed for refine_ms render the current image
+   * again with the slow filters, replacing the fast one getFrame shows.
+   */
+  void refineView(const int center, const ViewParams &params,
+                  const int last_gen, RenderScratch &scratch) {
+    uint32_t slot;
+    {
+      const boost::shared_ptr<const FrameOrder> o = getOrder();
+      if ((center < 0) || ((size_t)center >= o->slots.size()))
+        return;
+      slot = o->slots[center];
+    }
+    {
+      boost::mutex::scoped_lock l(render_mutex);
+      const boost::system_time still =
+          render_changed + boost::posix_time::milliseconds(refine_ms);
+      while (continue_loading && (render_gen == last_gen) &&
+             (boost::get_system_time() < still))
+        render_cond.timed_wait(l, still);
+      if (render_gen != last_gen)
+        return;
+      std::map<uint32_t, RenderedView>::const_iterator it =
+          rendered.find(slot);
+      if ((it != rendered.end()) && it->second.hq)
+        return;
+    }
+    RenderedView view;
+    bool complete;
+    {
+      STAGE_TIMER("render_hq");
+      complete =
+          renderView(getSlot(slot), params, orig_wait_ms, scratch, view, true);
+    }
+    boost::mutex::scoped_lock l(render_mutex);
+    if (complete && (render_gen == last_gen))
+      rendered[slot] = view;
+  }
+
+  // the frame getFrame returned last was a placeholder or rendered fast, or
+  // a jump is waiting on its image
+  bool isRefining() const { return isPlaceholder() || (!grid && refine_hq); }
+
+  // as isRefining without the pass with the slow filters, so the image
+  // itself isn't shown yet
+  bool isPlaceholder() const {
+    if (grid)
+      return grid_missing;
+    return !refine_name.empty() || !jump_name.empty() || refine_preview;
+  }
+
+  // and what it was waiting for has arrived
+  bool refineReady() {
+    if (grid)
+      return grid_made != grid_drawn;
+    int jump_ind;
+    if (!jump_name.empty())
+      return findRank(*getOrder(), jump_name, jump_ind);
+    if (refine_preview) {
+      const boost::shared_ptr<const FrameOrder> o = getOrder();
+      return (cur_slot >= o->rank.size()) || (o->rank[cur_slot] == NO_RANK);
+    }
+    if (refine_tiles)
+      return refine_tiles->isReady();
+    if (!refine_name.empty())
+      return frames_orig.touch(refine_name);
+    if (!refine_hq)
+      return false;
+    boost::mutex::scoped_lock l(render_mutex);
+    std::map<uint32_t, RenderedView>::const_iterator it =
+        rendered.find(cur_slot);
+    return (it != rendered.end()) && it->second.hq;
+  }
+
+  SortMode getSortMode() {
+    boost::mutex::scoped_lock l(order_mutex);
+    return sort_mode;
+  }
+
+  /* Reorder everything loaded so far, and what is loaded after, keeping
+   * the current image shown.
+   */
+  void setSortMode(const SortMode mode) {
+    {
+      boost::mutex::scoped_lock l(order_mutex);
+      if (mode == sort_mode)
+        return;
+      sort_mode = mode;
+      resort = true;
+    }
+    LOG(INFO) << "sorting by " << getSortModeName(mode);
+    flushOrder(true);
+  }
+
+  // where name is in o, false if it isn't decoded or not merged in yet
+  bool findRank(const FrameOrder &o, const std::string &name, int &rank) {
+    boost::mutex::scoped_lock l(order_mutex);
+    std::map<std::string, uint32_t>::const_iterator it =
+        slot_by_name.find(name);
+    if ((it == slot_by_name.end()) || (it->second >= o.rank.size()) ||
+        (o.rank[it->second] == NO_RANK))
+      return false;
+    rank = o.rank[it->second];
+    return true;
+  }
+
+  /* Go to the file at file_ind (clamped to the last one) in files, which
+   * may not be decoded yet. It is decoded next and getFrame shows it once
+   * it is.
+   */
+  void jumpToFile(size_t file_ind) {
+    {
+      boost::mutex::scoped_lock l(decode_mutex);
+      if (files.empty())
+        return;
+      file_ind = std::min(file_ind, files.size() - 1);
+      decode_center = file_ind;
+      jump_name = files[file_ind];
+      // the start of a video
+      if (isVideoName(jump_name))
+        jump_name = VideoFrames::getFrameName(jump_name, 0);
+    }
+    decode_cond.notify_all();
+  }
+
+  // the nth image, counting from 0, of all of them rather than only those
+  // decoded so far
+  void jumpTo(const int n) {
+    if (loaded) {
+      ind = std::min(std::max(n, 0), std::max(getNum() - 1, 0));
+      jump_name.clear();
+      return;
+    }
+    jumpToFile(std::max(n, 0));
+  }
+
+  // the image percent of the way through
+  void jumpToPercent(const int percent) {
+    size_t num;
+    if (loaded) {
+      num = getNum();
+    } else {
+      boost::mutex::scoped_lock l(decode_mutex);
+      num = files.size();
+    }
+    jumpTo(std::min(std::max(percent, 0), 100) * num / 100);
+  }
+
+  // navigation, relative to the image getFrame showed last
+  void moveInd(const int step) { ind += step; }
+
+  // leaving the overview shows the image selected in it
+  void setGrid(const bool on) { grid = on; }
+  bool isGrid() const { return grid; }
+  void setGridCols(const int cols) {
+    grid_cols = std::min(std::max(cols, 1), 32);
+  }
+  int getGridCols() const { return grid_cols; }
+
+  void setInd(const int new_ind) {
+    ind = new_ind;
+    jump_name.clear();
+  }
+
+  // the initial scan is done and everything it found is decoded or failed,
+  // watched directories may still add more afterwards
+  bool isLoaded() const { return loaded; }
+
+  int getNum() {
+    // boost::mutex::scoped_lock l(im_mutex);
+    // return frames_rendered.size();
+    return getOrder()->slots.size();
+  }
+
+  ////////////////////////////////////////////////////////////
+  cv::Rect getRoiRect(const int pad = 0, double zoom = 1.0) {
+    return getRoiRect(pad, zoom, roi_aspect);
+  }
+
+  cv::Rect getRoiRect(const int pad, double zoom, const float roi_aspect) {
+    float base_aspect = (float)sz.width / (float)sz.height;
+
+    int p2 = 0;
+    if (pad != 0)
+      p2 = 1;
+
+    cv::Rect roi;
+    if (roi_aspect == 1.0) {
+      roi.x = -1;
+      roi.y = -1;
+      roi.width = sz.width + 2;
+      roi.height = sz.height + 2;
+    } else if (roi_aspect > 1.0) {
+      roi.x = -pad + p2;
+      roi.width = sz.width + 2 * pad;
+
+      roi.height =
+          (int)((float)sz.width / (roi_aspect * base_aspect)) + 2 * pad;
+      roi.y = (sz.height - roi.height) / 2 - pad + p2;
+    } else {
+      roi.y = -pad + p2;
+      roi.height = sz.height + 2 * pad;
+
+      roi.width = (int)((float)sz.width * (roi_aspect * base_aspect)) + 2 * pad;
+      roi.x = (sz.width - roi.width) / 2 - pad + p2;
+    }
+
+    roi.x *= zoom;
+    roi.y *= zoom;
+    roi.width *= zoom;
+    roi.height *= zoom;
+
+    return roi;
+  }
+
+  /* Queue the part of the current image inside the roi box for writing,
+   * from the full resolution frame if it was shown scaled.
+   */
+  bool saveRoiImage() {
+    // cur_ind may have shifted since, the entry it showed hasn't
+    if ((cur_slot == NO_RANK) || cur_im.empty() || (cur_roi.width <= 0) ||
+        (cur_roi.height <= 0) || (cur_dst_rect.width <= 0) ||
+        (cur_dst_rect.height <= 0)) {
+      return false;
+    }
+    const FrameEntry &entry = entries[cur_slot];
+
+    // the roi box from window coordinates into cur_im
+    const cv::Rect box = getRoiRect(0) & cur_dst_rect;
+    const float sx = (float)cur_roi.width / cur_dst_rect.width;
+    const float sy = (float)cur_roi.height / cur_dst_rect.height;
+    const cv::Rect crop =
+        cv::Rect(cur_roi.x + (box.x - cur_dst_rect.x) * sx,
+                 cur_roi.y + (box.y - cur_dst_rect.y) * sy, box.width * sx,
+                 box.height * sy) &
+        cur_roi;
+
+    boost::function<cv::Mat()> load;
+    std::string name;
+    if (entry.tiles && entry.tiles->isReady()) {
+      // the tiles are lossy copies, so the crop is read from the file on the
+      // export thread, it is only located through them
+      float fx = (float)entry.full_size.width / cur_im.cols;
+      float fy = (float)entry.full_size.height / cur_im.rows;
+      cv::Point origin;
+      if (cur_tile_level >= 0) {
+        const cv::Size level_size = entry.tiles->getLevelSize(cur_tile_level);
+        fx = (float)entry.full_size.width / level_size.width;
+        fy = (float)entry.full_size.height / level_size.height;
+        origin = cur_tile_origin;
+      }
+      const cv::Rect full_crop((crop.x + origin.x) * fx,
+                               (crop.y + origin.y) * fy, crop.width * fx,
+                               crop.height * fy);
+      load = boost::bind(&TilePyramid::readRegion, entry.name, full_crop);
+      name = exports.push(entry.name, cv::Mat(), cv::Rect(), load);
+    } else {
+      if (cur_im.cols != entry.full_size.width)
+        load = boost::bind(&Images::getFullFrame, this, entry);
+      name = exports.push(entry.name, cur_im, crop, load);
+    }
+    VLOG(1) << "saving " << name;
+
+    // TBD put this image in the file/image array
+    return true;
+  }
+
+};
+
+// what part of the current image is shown
+struct View {
+  double zoom;
+  // where zoom center is
+  // TBD should image class store this per image?
+  // also panning around ought to be in pixel increments for big zooms
+  cv::Point2f pos;
+
+  // digits typed before a jump command, 0 if none
+  int count;
+
+  View() : zoom(1.0), pos(0.5, 0.5), count(0) {}
+};
+
+// the overview's own keys, false for the rest which work as usual
+inline bool handleGridKey(Images &images, const char key) {
+  const int cols = images.getGridCols();
+  if ((key == 'j') || (key == 'd'))
+    images.moveInd(1);
+  else if ((key == 'k') || (key == 's'))
+    images.moveInd(-1);
+  else if (key == 'f')
+    images.moveInd(cols);
+  else if (key == 'a')
+    images.moveInd(-cols);
+  else if (key == 'h')
+    images.setGridCols(cols - 1);
+  else if (key == 'l')
+    images.setGridCols(cols + 1);
+  else if ((key == 'v') || (key == '\r') || (key == '\n'))
+    images.setGrid(false);
+  else
+    return false;
+  return true;
+}
+
+/* Apply a navigation key to the images and view, returns false if the key
+ * isn't one of them. vimaj and vimaj_bench both go through here so replayed
+ * keys behave the same as typed ones.
+ */
+inline bool handleKey(Images &images, View &view, const char key) {
+  const float mv = 0.04;
+  const float pos_min = 0.0; //-0.25;
+  const float pos_max = 1.0 - pos_min;
+  double &zoom = view.zoom;
+  cv::Point2f &pos = view.pos;
+  // vi style counts, 12G goes to image 12 and 50% half way through
+  if ((key >= '0') && (key <= '9') && ((key != '0') || (view.count > 0))) {
+    view.count = std::min(view.count * 10 + (key - '0'), 100000000);
+    return true;
+  }
+  const int count = view.count;
+  view.count = 0;
+  if (images.isGrid() && handleGridKey(images, key))
+    return true;
+  if (key == 'G') {
+    if (count > 0)
+      images.jumpTo(count - 1);
+    else
+      images.jumpTo(std::numeric_limits<int>::max());
+  } else if (key == '%') {
+    images.jumpToPercent(count);
+  } else if (key == 'j') {
+    images.moveInd(1);
+  } else if (key == 'k') {
+    images.moveInd(-1);
+  } else if (key == 'n') {
+    images.setInd(0);
+  } else if (key == 'h') {
+    zoom *= 1.1;
+    if (zoom > 32.0)
+      zoom = 32.0;
+  } else if (key == 'l') {
+    zoom *= 0.95;
+    if (zoom < 1.0 / 32.0)
+      zoom = 1.0 / 32.0;
+  }
+  // scroll around
+  else if (key == 's') {
+    // pos.x *= (1.0 - 0.05/zoom);
+    pos.x -= mv / zoom;
+    if (pos.x < pos_min)
+      pos.x = pos_min;
+  } else if (key == 'd') {
+    // pos.x *= (1.0 + 0.04/zoom);
+    pos.x += mv / zoom;
+    if (pos.x > pos_max)
+      pos.x = pos_max;
+  } else if (key == 'f') {
+    // pos.y *= (1.0 + 0.05/zoom);
+    pos.y += mv / zoom;
+    if (pos.y > pos_max)
+      pos.y = pos_max;
+  } else if (key == 'a') {
+    // pos.y *= (1.0 - 0.04/zoom);
+    pos.y -= mv / zoom;
+    if (pos.y < pos_min)
+      pos.y = pos_min;
+  } else if (key == 'g') {
+    pos.x = 0.5;
+    pos.y = 0.5;
+    zoom = 1.0;
+    images.roi_aspect = 1.0;
+  } else if (key == 'e') {
+    // increase roi horizontal aspect
+    images.roi_aspect *= 1.05;
+  } else if (key == 'w') {
+    // increase roi horizontal aspect
+    images.roi_aspect *= 0.97;
+  } else if (key == 'p') {
+    images.saveRoiImage();
+  } else if (key == 'i') {
+    images.show_hud = !images.show_hud;
+  } else if (key == 'v') {
+    images.setGrid(true);
+  } else if (key == 'o') {
+    images.setSortMode(
+        (SortMode)((images.getSortMode() + 1) % NUM_SORT_MODES));
+  } else if (key == 'I') {
+    Stats::get().writeJson();
+  } else {
+    return false;
+  }
+  return true;
+}
+
+#endif // VIMAJ_IMAGES_H
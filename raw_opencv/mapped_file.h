@@ -0,0 +1,94 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIMAJ_MAPPED_FILE_H
+#define VIMAJ_MAPPED_FILE_H
+
+#include <fcntl.h>
+#include <limits.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "opencv2/imgcodecs.hpp"
+
+#include <glog/logging.h>
+
+/* A whole encoded image file mapped read only. The pages are read in when
+ * decoded and, being backed by the file, the kernel can drop them again
+ * under memory pressure, so holding many of these costs little more than
+ * their page tables. Each one is a mapping, which counts against
+ * vm.max_map_count.
+ * TBD a file truncated while mapped faults when decoded.
+ */
+class MappedFile {
+  std::string name;
+  void *data;
+  size_t size;
+
+  MappedFile(const MappedFile &);
+  MappedFile &operator=(const MappedFile &);
+
+public:
+  MappedFile() : data(NULL), size(0) {}
+
+  ~MappedFile() {
+    if (data != NULL)
+      munmap(data, size);
+  }
+
+  bool open(const std::string &name) {
+    const int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size == 0)) {
+      ::close(fd);
+      return false;
+    }
+    void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping keeps the file open
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+      LOG(WARNING) << "couldn't map " << name;
+      return false;
+    }
+    this->name = name;
+    data = mapped;
+    size = st.st_size;
+    return true;
+  }
+
+  bool isOpen() const { return data != NULL; }
+  size_t getSize() const { return size; }
+
+  // decoded straight from the mapped bytes without copying them, a file too
+  // big for a Mat's int columns is read again instead
+  cv::Mat decode(const int flags = cv::IMREAD_COLOR) const {
+    if (data == NULL)
+      return cv::Mat();
+    if (size > (size_t)INT_MAX)
+      return cv::imread(name, flags);
+    return cv::imdecode(cv::Mat(1, (int)size, CV_8UC1, data), flags);
+  }
+};
+
+#endif // VIMAJ_MAPPED_FILE_H
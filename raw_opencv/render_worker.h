@@ -0,0 +1,126 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIMAJ_RENDER_WORKER_H
+#define VIMAJ_RENDER_WORKER_H
+
+#include <deque>
+
+#include <boost/thread.hpp>
+
+#include "display.h"
+#include "images.h"
+
+/* Renders on its own thread so the ui thread only collects keys and shows
+ * whatever was rendered last. All the keys that arrived during a render are
+ * applied together before the next one, so holding a key down renders the
+ * latest state rather than every intermediate one. Only this thread touches
+ * images once started. Frames not rendered ahead are drawn straight into
+ * the display's image when it has one free.
+ */
+class RenderWorker {
+  Images &images;
+  DisplayBackend &display;
+  View view;
+
+  boost::thread thread;
+  boost::mutex mutex;
+  boost::condition_variable cond;
+  std::deque<char> keys;
+  bool run;
+
+  cv::Mat frame;
+  // incremented for each new frame
+  int frame_seq;
+
+  void runThread() {
+    bool have_frame = false;
+    while (true) {
+      std::deque<char> todo;
+      {
+        boost::mutex::scoped_lock l(mutex);
+        while (run && keys.empty()) {
+          // keep rendering until there is something to show, keep the
+          // timings current when they are, and replace a placeholder as soon
+          // as its full resolution frame arrives
+          const bool refining = images.isRefining();
+          if (!cond.timed_wait(l, boost::posix_time::milliseconds(
+                                      refining ? 10 : 100)) &&
+              (!have_frame || images.show_hud ||
+               (refining && images.refineReady())))
+            break;
+        }
+        if (!run)
+          break;
+        todo.swap(keys);
+      }
+
+      if (todo.size() > 1)
+        VLOG(2) << "coalesced " << todo.size() << " keys into one frame";
+      for (size_t i = 0; i < todo.size(); ++i)
+        handleKey(images, view, todo[i]);
+
+      cv::Mat im = images.getFrame(images.ind, view.zoom, view.pos,
+                                   display.acquireFrame());
+      display.releaseFrame();
+      if (im.empty())
+        continue;
+      have_frame = true;
+      boost::mutex::scoped_lock l(mutex);
+      frame = im;
+      frame_seq++;
+    }
+  }
+
+public:
+  RenderWorker(Images &images, DisplayBackend &display)
+      : images(images), display(display), run(true), frame_seq(0) {
+    thread = boost::thread(&RenderWorker::runThread, this);
+  }
+
+  ~RenderWorker() {
+    {
+      boost::mutex::scoped_lock l(mutex);
+      run = false;
+    }
+    cond.notify_all();
+    thread.join();
+  }
+
+  void pushKey(const char key) {
+    {
+      boost::mutex::scoped_lock l(mutex);
+      keys.push_back(key);
+    }
+    cond.notify_all();
+  }
+
+  // the latest frame if there is one newer than seq, which is updated
+  bool getFrame(cv::Mat &im, int &seq) {
+    boost::mutex::scoped_lock l(mutex);
+    if (frame_seq == seq)
+      return false;
+    im = frame;
+    seq = frame_seq;
+    return true;
+  }
+};
+
+#endif // VIMAJ_RENDER_WORKER_H
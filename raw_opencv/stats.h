@@ -0,0 +1,221 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIMAJ_STATS_H
+#define VIMAJ_STATS_H
+
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdint.h>
+#include <time.h>
+
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <glog/logging.h>
+
+/* Latency histogram with quarter octave buckets from 1 us up to about 16 s,
+ * recording is a few relaxed atomic increments so it can stay on in the
+ * hot paths.
+ */
+class LatencyHistogram {
+public:
+  static const int NUM_BUCKETS = 100;
+
+private:
+  boost::atomic<uint64_t> buckets[NUM_BUCKETS];
+  boost::atomic<uint64_t> count;
+  boost::atomic<uint64_t> total_us;
+  boost::atomic<uint64_t> max_us;
+
+  static int bucket(const uint64_t us) {
+    if (us < 1)
+      return 0;
+    // whole octaves from the highest bit, then two more bits for quarters
+    int octave = 63 - __builtin_clzll(us);
+    int quarter = 0;
+    if (octave >= 2)
+      quarter = (us >> (octave - 2)) & 3;
+    else if (octave == 1)
+      quarter = (us & 1) * 2;
+    const int b = octave * 4 + quarter;
+    return (b < NUM_BUCKETS) ? b : NUM_BUCKETS - 1;
+  }
+
+  // the upper edge of a bucket in microseconds
+  static double bucketEdge(const int b) {
+    return (1ULL << (b / 4)) * (1.0 + (b % 4 + 1) * 0.25);
+  }
+
+public:
+  LatencyHistogram() : count(0), total_us(0), max_us(0) {
+    for (int i = 0; i < NUM_BUCKETS; ++i)
+      buckets[i] = 0;
+  }
+
+  void record(const uint64_t us) {
+    buckets[bucket(us)].fetch_add(1, boost::memory_order_relaxed);
+    count.fetch_add(1, boost::memory_order_relaxed);
+    total_us.fetch_add(us, boost::memory_order_relaxed);
+    uint64_t prev = max_us.load(boost::memory_order_relaxed);
+    while ((us > prev) && !max_us.compare_exchange_weak(
+                              prev, us, boost::memory_order_relaxed))
+      ;
+  }
+
+  uint64_t getCount() const { return count.load(); }
+  double getMeanMs() const {
+    const uint64_t n = count.load();
+    return (n > 0) ? total_us.load() / 1000.0 / n : 0.0;
+  }
+  double getMaxMs() const { return max_us.load() / 1000.0; }
+
+  // approximate, the upper edge of the bucket holding the percentile
+  double getPercentileMs(const double p) const {
+    const uint64_t n = count.load();
+    if (n == 0)
+      return 0.0;
+    const uint64_t target = p * n;
+    uint64_t sum = 0;
+    for (int i = 0; i < NUM_BUCKETS; ++i) {
+      sum += buckets[i].load(boost::memory_order_relaxed);
+      if (sum > target)
+        return std::min(bucketEdge(i), (double)max_us.load()) / 1000.0;
+    }
+    return getMaxMs();
+  }
+};
+
+/* All the named stage histograms, use the STAGE_TIMER macro rather than
+ * looking these up by name in a hot path.
+ */
+class Stats {
+  boost::mutex mutex;
+  // in order of first use so the hud lines don't jump around
+  std::vector<std::pair<std::string, LatencyHistogram *> > stages;
+  std::string json_path;
+
+  Stats() {}
+
+public:
+  static Stats &get() {
+    static Stats stats;
+    return stats;
+  }
+
+  ~Stats() {
+    for (size_t i = 0; i < stages.size(); ++i)
+      delete stages[i].second;
+  }
+
+  LatencyHistogram *histogram(const std::string &name) {
+    boost::mutex::scoped_lock l(mutex);
+    for (size_t i = 0; i < stages.size(); ++i) {
+      if (stages[i].first == name)
+        return stages[i].second;
+    }
+    stages.push_back(std::make_pair(name, new LatencyHistogram()));
+    return stages.back().second;
+  }
+
+  std::string toJson() {
+    boost::mutex::scoped_lock l(mutex);
+    std::stringstream ss;
+    ss << "{\n";
+    for (size_t i = 0; i < stages.size(); ++i) {
+      const LatencyHistogram *h = stages[i].second;
+      ss << "  \"" << stages[i].first << "\": {\"count\": " << h->getCount()
+         << ", \"mean_ms\": " << h->getMeanMs()
+         << ", \"p50_ms\": " << h->getPercentileMs(0.5)
+         << ", \"p95_ms\": " << h->getPercentileMs(0.95)
+         << ", \"p99_ms\": " << h->getPercentileMs(0.99)
+         << ", \"max_ms\": " << h->getMaxMs() << "}"
+         << ((i + 1 < stages.size()) ? "," : "") << "\n";
+    }
+    ss << "}\n";
+    return ss.str();
+  }
+
+  // where writeJson goes, the log if empty
+  void setJsonPath(const std::string &path) { json_path = path; }
+
+  bool writeJson() {
+    if (json_path.empty()) {
+      LOG(INFO) << "stage timings\n" << toJson();
+      return true;
+    }
+    std::ofstream out(json_path.c_str());
+    out << toJson();
+    LOG(INFO) << "wrote stage timings to " << json_path;
+    return out.good();
+  }
+
+  // one line per stage in the top left corner
+  void drawHud(cv::Mat &dst, const int y0 = 24) {
+    boost::mutex::scoped_lock l(mutex);
+    int y = y0;
+    for (size_t i = 0; i < stages.size(); ++i) {
+      const LatencyHistogram *h = stages[i].second;
+      std::stringstream ss;
+      ss.precision(3);
+      ss << stages[i].first << " n " << h->getCount() << " p50 "
+         << h->getPercentileMs(0.5) << " p95 " << h->getPercentileMs(0.95)
+         << " p99 " << h->getPercentileMs(0.99) << " max " << h->getMaxMs()
+         << " ms";
+      // dark outline so it reads over any image
+      cv::putText(dst, ss.str(), cv::Point(10, y), 1, 1, cv::Scalar::all(0),
+                  3);
+      cv::putText(dst, ss.str(), cv::Point(10, y), 1, 1,
+                  cv::Scalar(150, 255, 150));
+      y += 14;
+    }
+  }
+};
+
+// records the time from construction to destruction
+class ScopedTimer {
+  LatencyHistogram *histogram;
+  struct timespec t0;
+
+public:
+  ScopedTimer(LatencyHistogram *histogram) : histogram(histogram) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+  }
+  ~ScopedTimer() {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    histogram->record((t1.tv_sec - t0.tv_sec) * 1000000 +
+                      (t1.tv_nsec - t0.tv_nsec) / 1000);
+  }
+};
+
+#define STAGE_TIMER_CAT2(a, b) a##b
+#define STAGE_TIMER_CAT(a, b) STAGE_TIMER_CAT2(a, b)
+// time the rest of the enclosing scope as the named stage
+#define STAGE_TIMER(name)                                                      \
+  static LatencyHistogram *STAGE_TIMER_CAT(stage_histogram_, __LINE__) =       \
+      Stats::get().histogram(name);                                            \
+  ScopedTimer STAGE_TIMER_CAT(stage_timer_, __LINE__)(                         \
+      STAGE_TIMER_CAT(stage_histogram_, __LINE__))
+
+#endif // VIMAJ_STATS_H
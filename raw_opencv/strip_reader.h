@@ -0,0 +1,206 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIMAJ_STRIP_READER_H
+#define VIMAJ_STRIP_READER_H
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <jpeglib.h>
+#include <png.h>
+
+/* Decodes a jpeg or png a band of rows at a time, for images larger than
+ * OpenCV will decode whole, which is 2^30 pixels unless
+ * OPENCV_IO_MAX_IMAGE_PIXELS is set before the library loads, or than are
+ * worth holding in memory at once. Rows come out as 8 bit BGR like imread
+ * gives them, but without the exif orientation applied.
+ * TBD interlaced pngs need the whole image and aren't read.
+ */
+class StripReader {
+  // libjpeg and libpng report errors by longjmp back into the call
+  struct JpegError {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+  };
+
+  FILE *file;
+  bool is_png;
+  int width;
+  int height;
+  int next_row;
+  struct jpeg_decompress_struct jpeg;
+  JpegError jpeg_error;
+  bool jpeg_created;
+  png_structp png;
+  png_infop png_info;
+
+  static void onJpegError(j_common_ptr cinfo) {
+    longjmp(((JpegError *)cinfo->err)->jump, 1);
+  }
+
+  // quiet, failures are reported by the return values
+  static void onJpegMessage(j_common_ptr) {}
+
+  static void onPngError(png_structp png, png_const_charp) {
+    longjmp(png_jmpbuf(png), 1);
+  }
+
+  static void onPngWarning(png_structp, png_const_charp) {}
+
+  bool openJpeg() {
+    jpeg.err = jpeg_std_error(&jpeg_error.mgr);
+    jpeg_error.mgr.error_exit = onJpegError;
+    jpeg_error.mgr.output_message = onJpegMessage;
+    if (setjmp(jpeg_error.jump))
+      return false;
+    jpeg_create_decompress(&jpeg);
+    jpeg_created = true;
+    jpeg_stdio_src(&jpeg, file);
+    jpeg_read_header(&jpeg, TRUE);
+    jpeg.out_color_space = JCS_EXT_BGR;
+    jpeg_start_decompress(&jpeg);
+    width = jpeg.output_width;
+    height = jpeg.output_height;
+    return jpeg.output_components == 3;
+  }
+
+  bool openPng() {
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, onPngError,
+                                 onPngWarning);
+    if (png == NULL)
+      return false;
+    png_info = png_create_info_struct(png);
+    if (png_info == NULL)
+      return false;
+    if (setjmp(png_jmpbuf(png)))
+      return false;
+    png_init_io(png, file);
+    png_read_info(png, png_info);
+    if (png_get_interlace_type(png, png_info) != PNG_INTERLACE_NONE)
+      return false;
+    const int color_type = png_get_color_type(png, png_info);
+    png_set_strip_16(png);
+    png_set_strip_alpha(png);
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+      png_set_palette_to_rgb(png);
+    if ((color_type == PNG_COLOR_TYPE_GRAY) ||
+        (color_type == PNG_COLOR_TYPE_GRAY_ALPHA)) {
+      png_set_expand_gray_1_2_4_to_8(png);
+      png_set_gray_to_rgb(png);
+    }
+    png_set_bgr(png);
+    png_read_update_info(png, png_info);
+    width = png_get_image_width(png, png_info);
+    height = png_get_image_height(png, png_info);
+    return png_get_rowbytes(png, png_info) == (size_t)width * 3;
+  }
+
+  // with setjmp the only thing in the frame, as longjmp skips destructors
+  bool readJpegRows(unsigned char *dst, const size_t stride, const int num) {
+    if (setjmp(jpeg_error.jump))
+      return false;
+    for (int i = 0; i < num; ++i) {
+      JSAMPROW row = dst + i * stride;
+      if (jpeg_read_scanlines(&jpeg, &row, 1) != 1)
+        return false;
+    }
+    return true;
+  }
+
+  bool readPngRows(unsigned char *dst, const size_t stride, const int num) {
+    if (setjmp(png_jmpbuf(png)))
+      return false;
+    for (int i = 0; i < num; ++i)
+      png_read_row(png, dst + i * stride, NULL);
+    return true;
+  }
+
+public:
+  StripReader()
+      : file(NULL), is_png(false), width(0), height(0), next_row(0),
+        jpeg_created(false), png(NULL), png_info(NULL) {}
+  ~StripReader() { close(); }
+
+  bool open(const std::string &name) {
+    close();
+    file = fopen(name.c_str(), "rb");
+    if (file == NULL)
+      return false;
+    unsigned char magic[8];
+    const bool have_magic = fread(magic, 1, sizeof(magic), file) == 8;
+    rewind(file);
+    if (!have_magic) {
+      close();
+      return false;
+    }
+    is_png = (png_sig_cmp(magic, 0, 8) == 0);
+    bool ok = false;
+    if (is_png)
+      ok = openPng();
+    else if ((magic[0] == 0xff) && (magic[1] == 0xd8))
+      ok = openJpeg();
+    if (!ok)
+      close();
+    return ok;
+  }
+
+  bool isOpen() const { return file != NULL; }
+  int getWidth() const { return width; }
+  int getHeight() const { return height; }
+  // the row the next readRows starts at
+  int getNextRow() const { return next_row; }
+
+  // num rows of width * 3 bytes, each stride apart, false past the end or
+  // on a decode error after which nothing more can be read
+  bool readRows(unsigned char *dst, const size_t stride, const int num) {
+    if ((file == NULL) || (num < 0) || (num > height - next_row))
+      return false;
+    const bool ok = is_png ? readPngRows(dst, stride, num)
+                           : readJpegRows(dst, stride, num);
+    if (!ok) {
+      close();
+      return false;
+    }
+    next_row += num;
+    return true;
+  }
+
+  void close() {
+    if (jpeg_created)
+      jpeg_destroy_decompress(&jpeg);
+    jpeg_created = false;
+    if (png != NULL)
+      png_destroy_read_struct(&png, (png_info != NULL) ? &png_info : NULL,
+                              NULL);
+    png = NULL;
+    png_info = NULL;
+    if (file != NULL)
+      fclose(file);
+    file = NULL;
+    width = 0;
+    height = 0;
+    next_row = 0;
+  }
+};
+
+#endif // VIMAJ_STRIP_READER_H
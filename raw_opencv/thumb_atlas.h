@@ -0,0 +1,129 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIMAJ_THUMB_ATLAS_H
+#define VIMAJ_THUMB_ATLAS_H
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+/* Thumbnails packed into a fixed number of cells of one image, enough for
+ * the rows on screen and a screen either side. A new thumbnail takes the
+ * cell that has gone longest without being drawn. Each cell is drawn
+ * whole, the thumbnail centered on black, so drawing one is a single copy.
+ */
+class ThumbAtlas {
+  boost::mutex mutex;
+  cv::Size cell;
+  // cells per row of atlas
+  int cols;
+  cv::Mat atlas;
+  // the key each cell holds, and when it was last drawn or put
+  std::vector<uint32_t> cell_keys;
+  std::vector<uint64_t> cell_used;
+  std::map<uint32_t, int> cell_of;
+  uint64_t use_count;
+  // incremented by each reset that empties it
+  int generation;
+
+  cv::Rect getCellRect(const int i) const {
+    return cv::Rect((i % cols) * cell.width, (i / cols) * cell.height,
+                    cell.width, cell.height);
+  }
+
+public:
+  ThumbAtlas() : cols(1), use_count(0), generation(0) {}
+
+  // empties it unless it already has these dimensions
+  void reset(const cv::Size new_cell, const int num_cells) {
+    boost::mutex::scoped_lock l(mutex);
+    if ((new_cell == cell) && (num_cells == (int)cell_keys.size()))
+      return;
+    cell = new_cell;
+    cols = std::max(1, (int)std::ceil(std::sqrt((double)num_cells)));
+    const int rows = (num_cells + cols - 1) / cols;
+    atlas = cv::Mat(rows * cell.height, cols * cell.width, CV_8UC3);
+    cell_keys.assign(num_cells, 0);
+    cell_used.assign(num_cells, 0);
+    cell_of.clear();
+    use_count = 0;
+    generation++;
+  }
+
+  cv::Size getCellSize() {
+    boost::mutex::scoped_lock l(mutex);
+    return cell;
+  }
+
+  int getGeneration() {
+    boost::mutex::scoped_lock l(mutex);
+    return generation;
+  }
+
+  bool has(const uint32_t key) {
+    boost::mutex::scoped_lock l(mutex);
+    return cell_of.count(key) > 0;
+  }
+
+  // copy the cell of key to dst, which is the cell size, false if absent
+  bool draw(const uint32_t key, cv::Mat &dst) {
+    boost::mutex::scoped_lock l(mutex);
+    std::map<uint32_t, int>::const_iterator it = cell_of.find(key);
+    if ((it == cell_of.end()) || (dst.size() != cell))
+      return false;
+    cell_used[it->second] = ++use_count;
+    atlas(getCellRect(it->second)).copyTo(dst);
+    return true;
+  }
+
+  /* thumb no larger than the cell, replacing the least recently used one,
+   * false if it was made for the cells of an earlier generation
+   */
+  bool put(const uint32_t key, const cv::Mat &thumb, const int gen) {
+    boost::mutex::scoped_lock l(mutex);
+    if ((gen != generation) || cell_keys.empty() ||
+        (thumb.type() != atlas.type()) || (thumb.cols > cell.width) ||
+        (thumb.rows > cell.height) || (cell_of.count(key) > 0))
+      return false;
+    const int i = std::min_element(cell_used.begin(), cell_used.end()) -
+                  cell_used.begin();
+    if (cell_used[i] > 0)
+      cell_of.erase(cell_keys[i]);
+    cell_keys[i] = key;
+    cell_used[i] = ++use_count;
+    cell_of[key] = i;
+    cv::Mat dst = atlas(getCellRect(i));
+    dst.setTo(cv::Scalar::all(0));
+    cv::Mat centered = dst(cv::Rect((cell.width - thumb.cols) / 2,
+                                    (cell.height - thumb.rows) / 2,
+                                    thumb.cols, thumb.rows));
+    thumb.copyTo(centered);
+    return true;
+  }
+};
+
+#endif // VIMAJ_THUMB_ATLAS_H
@@ -0,0 +1,374 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIMAJ_TILE_PYRAMID_H
+#define VIMAJ_TILE_PYRAMID_H
+
+#include <algorithm>
+#include <fstream>
+#include <list>
+#include <map>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/thread.hpp>
+
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <glog/logging.h>
+
+#include "file_index.h"
+#include "stats.h"
+#include "strip_reader.h"
+
+// decoded tiles, least recently used evicted first
+class TileCache {
+  struct Entry {
+    cv::Mat tile;
+    std::list<std::string>::iterator lru_it;
+  };
+  boost::mutex mutex;
+  std::map<std::string, Entry> entries;
+  // most recently used at the front
+  std::list<std::string> lru;
+  size_t budget;
+  size_t used;
+
+public:
+  TileCache(const size_t budget) : budget(budget), used(0) {}
+
+  // an empty Mat if not resident
+  cv::Mat get(const std::string &key) {
+    boost::mutex::scoped_lock l(mutex);
+    std::map<std::string, Entry>::iterator it = entries.find(key);
+    if (it == entries.end())
+      return cv::Mat();
+    lru.splice(lru.begin(), lru, it->second.lru_it);
+    return it->second.tile;
+  }
+
+  void put(const std::string &key, const cv::Mat &tile) {
+    boost::mutex::scoped_lock l(mutex);
+    if (tile.empty() || (entries.count(key) > 0))
+      return;
+    lru.push_front(key);
+    Entry &entry = entries[key];
+    entry.tile = tile;
+    entry.lru_it = lru.begin();
+    used += tile.total() * tile.elemSize();
+    while ((used > budget) && (lru.size() > 1)) {
+      std::map<std::string, Entry>::iterator it = entries.find(lru.back());
+      used -= it->second.tile.total() * it->second.tile.elemSize();
+      entries.erase(it);
+      lru.pop_back();
+    }
+  }
+};
+
+/* An image too big to decode whole every time it is zoomed into, cut once
+ * into fixed size tiles at full resolution and at every halving of it down
+ * to a single tile, and kept on disk. Rendering then only reads the tiles
+ * under the window at the level nearest the zoom, so the work and memory
+ * per frame go with the window size rather than the image size.
+ * The file is read a row of tiles at a time rather than decoded whole, so
+ * images past OpenCV's 2^30 pixel limit can be tiled too. Building holds a
+ * row of tiles of every level, about 120 MB for an image 40000 wide.
+ * TBD the exif orientation isn't applied, so rotated images aren't tiled,
+ * and pyramids of files since changed aren't cleaned up.
+ */
+class TilePyramid {
+  std::string dir;
+  cv::Size full_size;
+  int levels;
+  boost::atomic<bool> ready;
+
+  // rows of one level accumulating until they make a whole row of tiles
+  struct Band {
+    cv::Mat rows;
+    int filled;
+    // the row of tiles they will be
+    int ty;
+  };
+
+  std::string getTileName(const int level, const int tx, const int ty) const {
+    std::stringstream name;
+    name << dir << "/" << level << "_" << tx << "_" << ty << ".jpg";
+    return name.str();
+  }
+
+public:
+  static const int tile_size = 512;
+
+  /* Pyramids are named after the file along with its mtime and size, a
+   * changed file gets a new one.
+   */
+  TilePyramid(const std::string &tile_dir, const std::string &name,
+              const int64_t mtime, const uint64_t size,
+              const cv::Size full_size)
+      : full_size(full_size), levels(1), ready(false) {
+    std::stringstream key;
+    key << name << "_" << mtime << "_" << size;
+    std::stringstream path;
+    path << tile_dir << "/" << std::hex << fnv1a(key.str());
+    dir = path.str();
+    cv::Size level_size = full_size;
+    while ((level_size.width > tile_size) || (level_size.height > tile_size)) {
+      level_size =
+          cv::Size((level_size.width + 1) / 2, (level_size.height + 1) / 2);
+      levels++;
+    }
+  }
+
+  // use the tiles from an earlier build if it finished
+  bool load() {
+    std::ifstream in((dir + "/meta").c_str());
+    std::string magic;
+    int width;
+    int height;
+    int tile;
+    int num_levels;
+    if (!(in >> magic >> width >> height >> tile >> num_levels) ||
+        (magic != "VIMAJTP1") || (width != full_size.width) ||
+        (height != full_size.height) || (tile != tile_size) ||
+        (num_levels != levels))
+      return false;
+    ready = true;
+    return true;
+  }
+
+  // write the filled rows of a band as tiles, then halve them into the
+  // next level
+  bool flushBand(std::vector<Band> &bands, const int level,
+                 const std::vector<int> &params) {
+    Band &band = bands[level];
+    if (band.filled == 0)
+      return true;
+    const cv::Mat rows = band.rows.rowRange(0, band.filled);
+    for (int tx = 0; tx * tile_size < rows.cols; ++tx) {
+      const cv::Rect rect =
+          cv::Rect(tx * tile_size, 0, tile_size, tile_size) &
+          cv::Rect(0, 0, rows.cols, rows.rows);
+      if (!cv::imwrite(getTileName(level, tx, band.ty), rows(rect), params)) {
+        LOG(WARNING) << "couldn't write tile " << level << " " << tx << " "
+                     << band.ty << " to " << dir;
+        return false;
+      }
+    }
+    band.ty++;
+    band.filled = 0;
+    if (level + 1 >= levels)
+      return true;
+    cv::Mat half;
+    cv::resize(rows, half,
+               cv::Size(getLevelSize(level + 1).width, (rows.rows + 1) / 2), 0,
+               0, cv::INTER_AREA);
+    return addRows(bands, level + 1, half, params);
+  }
+
+  bool addRows(std::vector<Band> &bands, const int level, const cv::Mat &rows,
+               const std::vector<int> &params) {
+    Band &band = bands[level];
+    for (int done = 0; done < rows.rows;) {
+      const int num = std::min(rows.rows - done, tile_size - band.filled);
+      cv::Mat dst = band.rows.rowRange(band.filled, band.filled + num);
+      rows.rowRange(done, done + num).copyTo(dst);
+      band.filled += num;
+      done += num;
+      if ((band.filled == tile_size) && !flushBand(bands, level, params))
+        return false;
+    }
+    return true;
+  }
+
+  // from the file named, a row of tiles at a time
+  bool build(const std::string &name) {
+    StripReader reader;
+    if (!reader.open(name)) {
+      LOG(WARNING) << "can't tile " << dir << ", can't read " << name;
+      return false;
+    }
+    if ((reader.getWidth() != full_size.width) ||
+        (reader.getHeight() != full_size.height)) {
+      LOG(WARNING) << "can't tile " << dir << ", " << name << " is "
+                   << reader.getWidth() << " " << reader.getHeight()
+                   << " instead of " << full_size.width << " "
+                   << full_size.height;
+      return false;
+    }
+    try {
+      boost::filesystem::create_directories(dir);
+    } catch (const boost::filesystem::filesystem_error &ex) {
+      LOG(WARNING) << "can't tile: " << ex.what();
+      return false;
+    }
+    STAGE_TIMER("tile_build");
+    std::vector<int> params;
+    params.push_back(cv::IMWRITE_JPEG_QUALITY);
+    params.push_back(95);
+    std::vector<Band> bands(levels);
+    for (int level = 0; level < levels; ++level) {
+      bands[level].rows =
+          cv::Mat(tile_size, getLevelSize(level).width, CV_8UC3);
+      bands[level].filled = 0;
+      bands[level].ty = 0;
+    }
+    // the full resolution rows are read straight into their band
+    Band &first = bands[0];
+    while (reader.getNextRow() < full_size.height) {
+      first.filled =
+          std::min(tile_size, full_size.height - reader.getNextRow());
+      if (!reader.readRows(first.rows.ptr(0), first.rows.step, first.filled)) {
+        LOG(WARNING) << "can't tile " << dir << ", " << name
+                     << " failed to decode";
+        return false;
+      }
+      if (!flushBand(bands, 0, params))
+        return false;
+    }
+    // the partial last rows, each flush adding to the next level
+    for (int level = 1; level < levels; ++level) {
+      if (!flushBand(bands, level, params))
+        return false;
+    }
+
+    // written last so an interrupted build isn't mistaken for a finished one
+    const std::string meta = dir + "/meta";
+    const std::string tmp_meta = meta + ".tmp";
+    {
+      std::ofstream out(tmp_meta.c_str());
+      out << "VIMAJTP1 " << full_size.width << " " << full_size.height << " "
+          << tile_size << " " << levels << "\n";
+    }
+    if (rename(tmp_meta.c_str(), meta.c_str()) != 0)
+      return false;
+    LOG(INFO) << "tiled " << full_size.width << " " << full_size.height
+              << " into " << levels << " levels in " << dir;
+    ready = true;
+    return true;
+  }
+
+  bool isReady() const { return ready; }
+  int getLevels() const { return levels; }
+
+  cv::Size getLevelSize(const int level) const {
+    cv::Size level_size = full_size;
+    for (int i = 0; i < level; ++i)
+      level_size =
+          cv::Size((level_size.width + 1) / 2, (level_size.height + 1) / 2);
+    return level_size;
+  }
+
+  // from the cache if it is there and put in it if not, unless it is NULL
+  cv::Mat getTile(const int level, const int tx, const int ty,
+                  TileCache *cache) const {
+    const std::string name = getTileName(level, tx, ty);
+    cv::Mat tile;
+    if (cache != NULL)
+      tile = cache->get(name);
+    if (!tile.empty())
+      return tile;
+    {
+      STAGE_TIMER("tile_read");
+      tile = cv::imread(name);
+    }
+    if (tile.empty())
+      LOG(WARNING) << "missing tile " << name;
+    else if (cache != NULL)
+      cache->put(name, tile);
+    return tile;
+  }
+
+  // rect of the level composited from its tiles, black where one is missing
+  cv::Mat getRegion(const int level, const cv::Rect &rect,
+                    TileCache *cache) const {
+    const cv::Size level_size = getLevelSize(level);
+    const cv::Rect clipped =
+        rect & cv::Rect(0, 0, level_size.width, level_size.height);
+    if ((clipped.width <= 0) || (clipped.height <= 0))
+      return cv::Mat();
+    cv::Mat region(clipped.size(), CV_8UC3, cv::Scalar::all(0));
+    for (int ty = clipped.y / tile_size;
+         ty * tile_size < clipped.y + clipped.height; ++ty) {
+      for (int tx = clipped.x / tile_size;
+           tx * tile_size < clipped.x + clipped.width; ++tx) {
+        const cv::Mat tile = getTile(level, tx, ty, cache);
+        if (tile.empty() || (tile.type() != region.type()))
+          continue;
+        const cv::Rect tile_rect(tx * tile_size, ty * tile_size, tile.cols,
+                                 tile.rows);
+        const cv::Rect overlap = tile_rect & clipped;
+        if ((overlap.width <= 0) || (overlap.height <= 0))
+          continue;
+        cv::Mat dst = region(overlap - clipped.tl());
+        tile(overlap - tile_rect.tl()).copyTo(dst);
+      }
+    }
+    return region;
+  }
+
+  // the whole of the smallest level at least size, for the scaled frame
+  cv::Mat getLevelAtLeast(const cv::Size size, TileCache *cache) const {
+    int level = levels - 1;
+    while ((level > 0) && ((getLevelSize(level).width < size.width) ||
+                           (getLevelSize(level).height < size.height)))
+      level--;
+    const cv::Size level_size = getLevelSize(level);
+    return getRegion(level, cv::Rect(0, 0, level_size.width, level_size.height),
+                     cache);
+  }
+
+  /* rect of the full resolution image read from the file rather than the
+   * lossy tiles, without decoding the rest of it into memory
+   */
+  static cv::Mat readRegion(const std::string &name, const cv::Rect &rect) {
+    StripReader reader;
+    if (!reader.open(name))
+      return cv::Mat();
+    const cv::Rect clipped =
+        rect & cv::Rect(0, 0, reader.getWidth(), reader.getHeight());
+    if ((clipped.width <= 0) || (clipped.height <= 0))
+      return cv::Mat();
+    STAGE_TIMER("read_region");
+    cv::Mat region(clipped.size(), CV_8UC3);
+    cv::Mat band(64, reader.getWidth(), CV_8UC3);
+    const int end = clipped.y + clipped.height;
+    while (reader.getNextRow() < end) {
+      const int y = reader.getNextRow();
+      const int num = std::min(band.rows, end - y);
+      if (!reader.readRows(band.ptr(0), band.step, num))
+        return cv::Mat();
+      const cv::Rect overlap =
+          cv::Rect(0, y, reader.getWidth(), num) & clipped;
+      if (overlap.height <= 0)
+        continue;
+      cv::Mat dst = region(overlap - clipped.tl());
+      band(overlap - cv::Point(0, y)).copyTo(dst);
+    }
+    return region;
+  }
+};
+
+#endif // VIMAJ_TILE_PYRAMID_H
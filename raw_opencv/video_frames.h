@@ -0,0 +1,393 @@
+/*
+
+  Copyright 2012-2020 Lucas Walter
+
+    This file is part of Vimaj.
+
+    Vimjay is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Vimjay is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Vimjay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIMAJ_VIDEO_FRAMES_H
+#define VIMAJ_VIDEO_FRAMES_H
+
+#include <fstream>
+#include <list>
+#include <map>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "opencv2/videoio.hpp"
+
+#include <glog/logging.h>
+
+#include "file_index.h"
+#include "stats.h"
+
+inline bool isVideoName(const std::string &name) {
+  const std::string ext = boost::algorithm::to_lower_copy(
+      boost::filesystem::path(name).extension().string());
+  return (ext == ".mp4") || (ext == ".mov") || (ext == ".avi") ||
+         (ext == ".mkv") || (ext == ".webm") || (ext == ".m4v");
+}
+
+/* Each frame of a video stands in for an image file named path#frame, so
+ * the rest of the viewer handles them like stills, except that frames are
+ * only read while they are near the one shown. The first time a video is
+ * opened every frame is grabbed once to count them and record their
+ * timestamps, which are kept in the cache dir until the file changes, so
+ * open is for a background thread.
+ * Frame counts from the container can be off and seeking by frame number
+ * goes through the frame rate, so seeks go to the recorded timestamp
+ * instead. Readers are kept open between frames and a frame a little ahead
+ * of one is grabbed up to rather than seeked to, which makes stepping
+ * through in order about as fast as playing.
+ * TBD OpenCV doesn't say which frames are keyframes, with those the index
+ * could tell how far forward grabbing beats seeking.
+ */
+class VideoFrames {
+  struct Reader {
+    cv::VideoCapture cap;
+    // the frame the next grab returns
+    int next;
+  };
+
+  struct Video {
+    std::string path;
+    // timestamp of each frame
+    std::vector<double> msec;
+    cv::Size size;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::list<boost::shared_ptr<Reader> > idle;
+    int num_readers;
+
+    Video() : num_readers(0) {}
+  };
+
+  boost::mutex mutex;
+  std::map<std::string, boost::shared_ptr<Video> > videos;
+  // empty for not keeping the indices
+  std::string cache_dir;
+
+  // open readers per video, each is a decoder with its own buffers
+  static const int max_readers = 4;
+  // further ahead than this seek rather than grab
+  static const int max_grab_ahead = 48;
+
+  VideoFrames() {}
+
+  static bool statVideo(const std::string &path, int64_t &mtime,
+                        uint64_t &size) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+      return false;
+    mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    size = st.st_size;
+    return true;
+  }
+
+  std::string getIndexName(const std::string &path) {
+    std::string key = path;
+    try {
+      key = boost::filesystem::canonical(path).string();
+    } catch (const boost::filesystem::filesystem_error &) {
+    }
+    std::stringstream name;
+    name << cache_dir << "/" << std::hex << fnv1a(key) << ".vindex";
+    return name.str();
+  }
+
+  bool loadIndex(const std::string &path, Video &video) {
+    int64_t mtime;
+    uint64_t size;
+    if (cache_dir.empty() || !statVideo(path, mtime, size))
+      return false;
+    std::ifstream in(getIndexName(path).c_str(), std::ios::binary);
+    char magic[8];
+    int64_t index_mtime;
+    uint64_t index_size;
+    uint32_t num;
+    int32_t dims[2];
+    if (!in.read(magic, sizeof(magic)) ||
+        (std::string(magic, sizeof(magic)) != "VIMAJVX2") ||
+        !in.read((char *)&index_mtime, sizeof(index_mtime)) ||
+        !in.read((char *)&index_size, sizeof(index_size)) ||
+        !in.read((char *)&num, sizeof(num)) ||
+        !in.read((char *)dims, sizeof(dims)) || (index_mtime != mtime) ||
+        (index_size != size))
+      return false;
+    video.size = cv::Size(dims[0], dims[1]);
+    video.msec.resize(num);
+    if ((num > 0) && !in.read((char *)&video.msec[0], num * sizeof(double)))
+      return false;
+    return true;
+  }
+
+  void saveIndex(const std::string &path, const Video &video) {
+    int64_t mtime;
+    uint64_t size;
+    if (cache_dir.empty() || !statVideo(path, mtime, size))
+      return;
+    try {
+      boost::filesystem::create_directories(cache_dir);
+    } catch (const boost::filesystem::filesystem_error &ex) {
+      LOG(WARNING) << "no video index: " << ex.what();
+      return;
+    }
+    const std::string name = getIndexName(path);
+    const std::string tmp_name = name + ".tmp";
+    std::ofstream out(tmp_name.c_str(), std::ios::binary | std::ios::trunc);
+    const uint32_t num = video.msec.size();
+    const int32_t dims[2] = {video.size.width, video.size.height};
+    out.write("VIMAJVX2", 8);
+    out.write((const char *)&mtime, sizeof(mtime));
+    out.write((const char *)&size, sizeof(size));
+    out.write((const char *)&num, sizeof(num));
+    out.write((const char *)dims, sizeof(dims));
+    if (num > 0)
+      out.write((const char *)&video.msec[0], num * sizeof(double));
+    out.close();
+    if (!out.good() || (rename(tmp_name.c_str(), name.c_str()) != 0)) {
+      LOG(WARNING) << "couldn't write video index " << name;
+      unlink(tmp_name.c_str());
+    }
+  }
+
+  // grab every frame once, the first is decoded for the size
+  static bool buildIndex(const std::string &path, Video &video) {
+    const boost::posix_time::ptime t0 =
+        boost::posix_time::microsec_clock::universal_time();
+    cv::VideoCapture cap(path);
+    if (!cap.isOpened())
+      return false;
+    {
+      STAGE_TIMER("video_index");
+      while (cap.grab()) {
+        video.msec.push_back(cap.get(cv::CAP_PROP_POS_MSEC));
+        if (video.msec.size() == 1) {
+          cv::Mat first;
+          if (cap.retrieve(first))
+            video.size = first.size();
+        }
+      }
+    }
+    LOG(INFO) << "indexed " << video.msec.size() << " frames of " << path
+              << " in "
+              << (boost::posix_time::microsec_clock::universal_time() - t0)
+                         .total_milliseconds() /
+                     1000.0
+              << " s";
+    return !video.msec.empty() && (video.size.area() > 0);
+  }
+
+  boost::shared_ptr<Video> findVideo(const std::string &path) {
+    boost::mutex::scoped_lock l(mutex);
+    std::map<std::string, boost::shared_ptr<Video> >::iterator it =
+        videos.find(path);
+    if (it == videos.end())
+      return boost::shared_ptr<Video>();
+    return it->second;
+  }
+
+  // a reader that can get to frame soonest, opening or waiting for one
+  boost::shared_ptr<Reader> takeReader(Video &video, const int frame) {
+    boost::mutex::scoped_lock l(video.mutex);
+    while (true) {
+      std::list<boost::shared_ptr<Reader> >::iterator best = video.idle.end();
+      for (std::list<boost::shared_ptr<Reader> >::iterator it =
+               video.idle.begin();
+           it != video.idle.end(); ++it) {
+        const int ahead = frame - (*it)->next;
+        if ((ahead >= 0) && (ahead < max_grab_ahead) &&
+            ((best == video.idle.end()) || (ahead < frame - (*best)->next)))
+          best = it;
+      }
+      // otherwise a new one if allowed, since seeking an idle one loses its
+      // place, or any idle one
+      if ((best == video.idle.end()) && (video.num_readers < max_readers)) {
+        video.num_readers++;
+        l.unlock();
+        boost::shared_ptr<Reader> reader(new Reader);
+        reader->next = 0;
+        if (!reader->cap.open(video.path)) {
+          LOG(WARNING) << "couldn't open " << video.path;
+          l.lock();
+          video.num_readers--;
+          return boost::shared_ptr<Reader>();
+        }
+        return reader;
+      }
+      if ((best == video.idle.end()) && !video.idle.empty())
+        best = video.idle.begin();
+      if (best != video.idle.end()) {
+        boost::shared_ptr<Reader> reader = *best;
+        video.idle.erase(best);
+        return reader;
+      }
+      video.cond.wait(l);
+    }
+  }
+
+  void returnReader(Video &video, const boost::shared_ptr<Reader> &reader) {
+    {
+      boost::mutex::scoped_lock l(video.mutex);
+      if (reader)
+        video.idle.push_front(reader);
+      else
+        video.num_readers--;
+    }
+    video.cond.notify_one();
+  }
+
+  // leaves the reader having just grabbed frame, false if it couldn't
+  static bool seek(Reader &reader, const Video &video, const int frame) {
+    STAGE_TIMER("video_seek");
+    const double target = video.msec[frame];
+    // seeking lands on or before the target, except with some containers
+    // where it overshoots, then back off a second
+    for (double back = 0.0; back <= 1000.0; back += 1000.0) {
+      reader.cap.set(cv::CAP_PROP_POS_MSEC, std::max(target - back, 0.0));
+      // find where it actually is by grabbing
+      if (!reader.cap.grab())
+        return false;
+      const double at = reader.cap.get(cv::CAP_PROP_POS_MSEC);
+      std::vector<double>::const_iterator it =
+          std::lower_bound(video.msec.begin(), video.msec.end(), at - 0.5);
+      if ((it == video.msec.end()) || (it - video.msec.begin() > frame))
+        continue;
+      reader.next = it - video.msec.begin() + 1;
+      return grabThrough(reader, frame);
+    }
+    return false;
+  }
+
+  static bool grabThrough(Reader &reader, const int frame) {
+    while (reader.next <= frame) {
+      if (!reader.cap.grab())
+        return false;
+      reader.next++;
+    }
+    return true;
+  }
+
+public:
+  static VideoFrames &get() {
+    static VideoFrames video_frames;
+    return video_frames;
+  }
+
+  void setCacheDir(const std::string &dir) {
+    boost::mutex::scoped_lock l(mutex);
+    cache_dir = dir;
+  }
+
+  static std::string getFrameName(const std::string &path, const int frame) {
+    std::stringstream name;
+    name << path << "#" << frame;
+    return name.str();
+  }
+
+  // split a name from getFrameName, false for anything else
+  static bool parseFrameName(const std::string &name, std::string &path,
+                             int &frame) {
+    const size_t hash = name.rfind('#');
+    if ((hash == std::string::npos) || (hash + 1 >= name.size()) ||
+        (name.find_first_not_of("0123456789", hash + 1) != std::string::npos))
+      return false;
+    path = name.substr(0, hash);
+    if (!isVideoName(path))
+      return false;
+    frame = atoi(name.c_str() + hash + 1);
+    return true;
+  }
+
+  // the file a name refers to, which is the name itself unless a frame
+  static std::string getPath(const std::string &name) {
+    std::string path;
+    int frame;
+    if (parseFrameName(name, path, frame))
+      return path;
+    return name;
+  }
+
+  /* The number of frames and their size, indexing the video if it hasn't
+   * been, 0 if it can't be read.
+   */
+  int open(const std::string &path, cv::Size &size) {
+    boost::shared_ptr<Video> video = findVideo(path);
+    if (video) {
+      size = video->size;
+      return video->msec.size();
+    }
+
+    video.reset(new Video);
+    video->path = path;
+    if (!loadIndex(path, *video)) {
+      video->msec.clear();
+      if (!buildIndex(path, *video))
+        return 0;
+      saveIndex(path, *video);
+    }
+    boost::mutex::scoped_lock l(mutex);
+    videos[path] = video;
+    size = video->size;
+    return video->msec.size();
+  }
+
+  // an empty Mat if name isn't a frame of an open video
+  cv::Mat read(const std::string &name) {
+    std::string path;
+    int frame;
+    cv::Mat im;
+    if (!parseFrameName(name, path, frame))
+      return im;
+    boost::shared_ptr<Video> video = findVideo(path);
+    if (!video || (frame >= (int)video->msec.size()))
+      return im;
+
+    boost::shared_ptr<Reader> reader = takeReader(*video, frame);
+    if (!reader)
+      return im;
+    const int ahead = frame - reader->next;
+    bool ok;
+    if ((ahead >= 0) && (ahead < max_grab_ahead)) {
+      STAGE_TIMER("video_grab");
+      ok = grabThrough(*reader, frame);
+    } else {
+      ok = seek(*reader, *video, frame);
+    }
+    if (!ok || !reader->cap.retrieve(im)) {
+      LOG(WARNING) << "couldn't read frame " << frame << " of " << path;
+      im.release();
+      // lost its place
+      reader->next = -max_grab_ahead;
+    }
+    returnReader(*video, reader);
+    return im;
+  }
+};
+
+#endif // VIMAJ_VIDEO_FRAMES_H